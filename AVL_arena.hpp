@@ -0,0 +1,293 @@
+#pragma once
+#include "AVL_tree.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace AVL
+{
+// normal: 4 KB pages; transparent: THP requested with madvise; hugetlb: explicit 2 MB pages
+// from the reserved pool (vm.nr_hugepages), falling back to transparent when it is exhausted
+enum class page_mode_t { normal, transparent, hugetlb };
+// local: first touch; interleave: pages round-robin over all nodes; preferred: on one node
+// while it has free memory, for replicas read by threads pinned to that node
+enum class numa_policy_t { local, interleave, preferred };
+
+namespace detail
+{
+constexpr std::size_t huge_page = 2 << 20;
+inline std::size_t page_size() {
+	static const auto size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	return size;
+}
+// from <linux/mempolicy.h>, libc has no mbind wrapper without libnuma
+constexpr int mpol_preferred = 1;
+constexpr int mpol_interleave = 3;
+} //namespace detail
+
+// number of NUMA nodes the kernel supports, 1 when it cannot be read
+inline int numa_nodes() {
+	std::ifstream file{"/sys/devices/system/node/possible"};
+	std::string nodes;
+	if (!(file >> nodes))
+		return 1;
+	// "0" or a list of ranges such as "0-3"; the last number is the highest node
+	auto last = nodes.find_last_of("-,");
+	return std::atoi(nodes.c_str() + ((last == std::string::npos) ? 0 : last + 1)) + 1;
+}
+
+// Node storage carved from large anonymous mappings: nodes are bumped out of chunks that
+// start at first_chunk and double in size up to max_chunk, and freed nodes are reused through
+// a free list. Chunks are 2 MB aligned multiples of 2 MB unless pages are normal, then whole
+// pages. Placement and page size are fixed per mapping, so a set built in an arena keeps them.
+class AVL_arena_t final : public AVL_storage_t {
+	struct chunk_t {
+		char *mem;
+		std::size_t size;
+		// bytes handed out so far, kept up to date by add_chunk and trim
+		std::size_t used;
+		bool hugetlb;
+	};
+	page_mode_t pages_;
+	numa_policy_t numa_;
+	int node_;
+	std::size_t first_chunk_;
+	std::size_t next_chunk_;
+	std::size_t max_chunk_;
+	std::vector<chunk_t> chunks_;
+	char *cur_ = nullptr;
+	char *end_ = nullptr;
+	void *free_ = nullptr;
+	std::size_t slot_ = 0;
+	std::size_t live_ = 0;
+	// while a reserve lasts allocations are bumped past the free list, into the runs
+	// [begin, end) of earlier chunks and [run_, cur_) of the current one
+	std::vector<std::pair<char *, char *>> runs_;
+	char *run_ = nullptr;
+	std::size_t hugetlb_bytes_ = 0;
+	bool numa_failed_ = false;
+
+	std::size_t round_up(std::size_t size) const {
+		auto granule = (pages_ == page_mode_t::normal) ? detail::page_size() : detail::huge_page;
+		return std::max((size + granule - 1) / granule, std::size_t{1}) * granule;
+	}
+	void *map(std::size_t size, bool &hugetlb);
+	void add_chunk(std::size_t min_size = 0);
+	void unmap_all() {
+		for (auto &chunk : chunks_)
+			munmap(chunk.mem, chunk.size);
+		chunks_.clear();
+		cur_ = end_ = nullptr;
+		free_ = nullptr;
+		runs_.clear();
+		run_ = nullptr;
+		live_ = hugetlb_bytes_ = 0;
+		next_chunk_ = first_chunk_;
+	}
+
+	public:
+	explicit AVL_arena_t(page_mode_t pages = page_mode_t::transparent, numa_policy_t numa = numa_policy_t::local,
+			     int node = 0, std::size_t max_chunk = 1 << 30, std::size_t first_chunk = detail::huge_page) :
+		pages_(pages), numa_(numa), node_(node), first_chunk_(round_up(first_chunk)), next_chunk_(first_chunk_),
+		max_chunk_(std::max(round_up(max_chunk), first_chunk_))
+	{
+		assert(node >= 0);
+	}
+	AVL_arena_t(const AVL_arena_t &other) = delete;
+	AVL_arena_t &operator = (const AVL_arena_t &rhs) = delete;
+	~AVL_arena_t() {
+		unmap_all();
+	}
+
+	// all allocations have the size of the first one, the node size of the tree using the arena
+	void *allocate(std::size_t size) override {
+		if (!slot_)
+			slot_ = std::max(size, sizeof(void *));
+		assert(size <= slot_);
+		live_++;
+		if (free_ && !run_) {
+			auto ptr = free_;
+			free_ = *static_cast<void **>(ptr);
+			return ptr;
+		}
+		if (static_cast<std::size_t>(end_ - cur_) < slot_) {
+			if (run_)
+				runs_.emplace_back(run_, cur_);
+			add_chunk();
+			if (run_)
+				run_ = cur_;
+		}
+		auto ptr = cur_;
+		cur_ += slot_;
+		return ptr;
+	}
+	void deallocate(void *ptr, std::size_t size) override {
+		(void)size;
+		assert(ptr && live_);
+		*static_cast<void **>(ptr) = free_;
+		free_ = ptr;
+		live_--;
+	}
+	bool release(std::size_t live_nodes) override {
+		if (live_nodes != live_)
+			return false;
+		unmap_all();
+		return true;
+	}
+	// nodes are bumped in allocation order from one chunk with room for n of them, and from
+	// further chunks if more follow; freed nodes are reused again once the reserve ends
+	void reserve(std::size_t size, std::size_t n) override {
+		runs_.clear();
+		run_ = nullptr;
+		if (!n)
+			return;
+		if (!slot_)
+			slot_ = std::max(size, sizeof(void *));
+		if (static_cast<std::size_t>(end_ - cur_) < n * slot_)
+			add_chunk(n * slot_);
+		run_ = cur_;
+	}
+	bool reserved(const void *ptr) const override {
+		auto in = [ptr](const char *begin, const char *end) {
+			return begin <= ptr && ptr < end;
+		};
+		if (run_ && in(run_, cur_))
+			return true;
+		for (auto &run : runs_)
+			if (in(run.first, run.second))
+				return true;
+		return false;
+	}
+	// also ends a reserve
+	void trim() override;
+
+	std::size_t live() const {
+		return live_;
+	}
+	std::size_t mapped_bytes() const {
+		std::size_t bytes = 0;
+		for (auto &chunk : chunks_)
+			bytes += chunk.size;
+		return bytes;
+	}
+	// bytes of chunks backed by the hugetlb pool rather than by the fallback
+	std::size_t hugetlb_bytes() const {
+		return hugetlb_bytes_;
+	}
+	// the NUMA policy could not be applied, e.g. mbind is not permitted in a container
+	bool numa_failed() const {
+		return numa_failed_;
+	}
+};
+
+inline void *AVL_arena_t::map(std::size_t size, bool &hugetlb) {
+	hugetlb = false;
+	if (pages_ == page_mode_t::hugetlb) {
+		auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			hugetlb = true;
+			hugetlb_bytes_ += size;
+			return mem;
+		}
+	}
+	// over-map to trim the chunk to a 2 MB boundary, THP only backs aligned ranges
+	auto extra = (pages_ == page_mode_t::normal) ? 0 : detail::huge_page;
+	auto mem = mmap(nullptr, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		throw std::bad_alloc{};
+	if (!extra)
+		return mem;
+	auto addr = reinterpret_cast<std::uintptr_t>(mem);
+	auto aligned = (addr + detail::huge_page - 1) & ~(detail::huge_page - 1);
+	if (aligned > addr)
+		munmap(mem, aligned - addr);
+	if (aligned + size < addr + size + extra)
+		munmap(reinterpret_cast<void *>(aligned + size), addr + extra - aligned);
+	mem = reinterpret_cast<void *>(aligned);
+	madvise(mem, size, MADV_HUGEPAGE);
+	return mem;
+}
+
+inline void AVL_arena_t::add_chunk(std::size_t min_size) {
+	auto size = std::max(next_chunk_, round_up(min_size));
+	bool hugetlb;
+	auto mem = map(size, hugetlb);
+	if (cur_)
+		chunks_.back().used = cur_ - chunks_.back().mem;
+	chunks_.push_back({static_cast<char *>(mem), size, 0, hugetlb});
+	next_chunk_ = std::min(2 * next_chunk_, max_chunk_);
+	if (numa_ != numa_policy_t::local) {
+		// the policy has to be set before the first touch of the pages
+		auto nodes = numa_nodes();
+		std::vector<unsigned long> mask((std::max(nodes, node_ + 1) + 63) / 64);
+		auto mode = detail::mpol_preferred;
+		if (numa_ == numa_policy_t::interleave) {
+			mode = detail::mpol_interleave;
+			for (auto i = 0; i < nodes; ++i)
+				mask[i / 64] |= 1UL << (i % 64);
+		}
+		else
+			mask[node_ / 64] |= 1UL << (node_ % 64);
+		if (syscall(SYS_mbind, mem, size, mode, mask.data(), mask.size() * 64 + 1, 0))
+			numa_failed_ = true;
+	}
+	cur_ = static_cast<char *>(mem);
+	end_ = cur_ + size;
+}
+
+// unmaps the chunks all of whose nodes were freed and drops them from the free list
+inline void AVL_arena_t::trim() {
+	runs_.clear();
+	run_ = nullptr;
+	if (chunks_.empty())
+		return;
+	if (cur_)
+		chunks_.back().used = cur_ - chunks_.back().mem;
+	std::vector<std::size_t> order(chunks_.size()), n_free(chunks_.size());
+	for (std::size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [this](std::size_t lhs, std::size_t rhs) {
+		return chunks_[lhs].mem < chunks_[rhs].mem;
+	});
+	auto chunk_of = [this, &order](void *ptr) {
+		auto it = std::upper_bound(order.begin(), order.end(), static_cast<char *>(ptr), [this](char *ptr, std::size_t i) {
+			return ptr < chunks_[i].mem;
+		});
+		return *(it - 1);
+	};
+	for (auto ptr = free_; ptr; ptr = *static_cast<void **>(ptr))
+		n_free[chunk_of(ptr)]++;
+	std::vector<bool> empty(chunks_.size());
+	for (std::size_t i = 0; i < chunks_.size(); ++i)
+		empty[i] = n_free[i] * slot_ == chunks_[i].used;
+	void **tail = &free_;
+	for (auto ptr = free_; ptr; ptr = *static_cast<void **>(ptr))
+		if (!empty[chunk_of(ptr)]) {
+			*tail = ptr;
+			tail = static_cast<void **>(ptr);
+		}
+	*tail = nullptr;
+	if (empty.back())
+		cur_ = end_ = nullptr;
+	std::size_t kept = 0;
+	for (std::size_t i = 0; i < chunks_.size(); ++i) {
+		if (!empty[i]) {
+			chunks_[kept++] = chunks_[i];
+			continue;
+		}
+		munmap(chunks_[i].mem, chunks_[i].size);
+		if (chunks_[i].hugetlb)
+			hugetlb_bytes_ -= chunks_[i].size;
+	}
+	chunks_.resize(kept);
+}
+} //namespace AVL
@@ -0,0 +1,257 @@
+#pragma once
+#include "AVL_set.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace AVL
+{
+namespace detail
+{
+using file_ptr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+// Buffered sequential reader of a binary file of T, usable as InputIt of AVL_tree_t::build_sorted
+template <typename T>
+class run_reader_t final {
+	std::FILE *file_;
+	std::vector<T> buf_;
+	std::size_t pos_ = 0;
+	std::size_t len_ = 0;
+	void fill() {
+		len_ = std::fread(buf_.data(), sizeof(T), buf_.size(), file_);
+		pos_ = 0;
+	}
+
+	public:
+	run_reader_t(std::FILE *file, std::size_t buf_size) : file_(file), buf_(buf_size) {
+		fill();
+	}
+	bool done() const {
+		return pos_ == len_;
+	}
+	const T &operator * () const {
+		assert(!done());
+		return buf_[pos_];
+	}
+	run_reader_t &operator ++ () {
+		if (++pos_ == len_)
+			fill();
+		return *this;
+	}
+};
+
+template <typename T>
+void write_all(std::FILE *file, const T *data, std::size_t n) {
+	if (std::fwrite(data, sizeof(T), n, file) != n)
+		throw std::runtime_error{"AVL: failed to write sorted run"};
+}
+} //namespace detail
+
+// Sorts n elements read from first into a binary file of T at out_path and returns n.
+// At most run_size elements are held in memory: each full run is sorted with up to threads
+// threads and spilled to a temporary file in the background while the next one is read,
+// then runs are k-way merged. first is advanced only between elements, so it may be an
+// istream_iterator over a longer stream.
+template <typename T, typename InputIt>
+std::size_t external_sort(InputIt first, std::size_t n, const std::string &out_path,
+			  std::size_t run_size = 1 << 24, std::size_t buf_size = 1 << 16, unsigned threads = 1) {
+	static_assert(std::is_trivially_copyable_v<T>);
+	assert(run_size && buf_size);
+	std::vector<detail::file_ptr> runs;
+	auto spill_run = [&runs, threads](std::vector<T> &run) {
+		detail::parallel_sort(run.begin(), run.end(), threads);
+		detail::file_ptr file{std::tmpfile(), &std::fclose};
+		if (!file)
+			throw std::runtime_error{"AVL: failed to create temporary run file"};
+		detail::write_all(file.get(), run.data(), run.size());
+		std::rewind(file.get());
+		runs.push_back(std::move(file));
+	};
+
+	std::vector<T> run, sorting;
+	std::future<void> spilling;
+	for (std::size_t read = 0; read < n;) {
+		run.clear();
+		run.reserve(std::min(run_size, n - read));
+		for (; read < n && run.size() < run_size; ++read) {
+			run.push_back(*first);
+			if (read + 1 < n)
+				++first;
+		}
+		if (spilling.valid())
+			spilling.get();
+		std::swap(run, sorting);
+		spilling = std::async(std::launch::async, spill_run, std::ref(sorting));
+	}
+	if (spilling.valid())
+		spilling.get();
+	run = std::vector<T>{};
+	sorting = std::vector<T>{};
+
+	detail::file_ptr out{std::fopen(out_path.c_str(), "wb"), &std::fclose};
+	if (!out)
+		throw std::runtime_error{"AVL: failed to open " + out_path};
+	std::vector<detail::run_reader_t<T>> readers;
+	readers.reserve(runs.size());
+	for (auto &file : runs)
+		readers.emplace_back(file.get(), buf_size);
+
+	using head_t = std::pair<T, std::size_t>;
+	auto greater = [](const head_t &lhs, const head_t &rhs) { return rhs.first < lhs.first; };
+	std::priority_queue<head_t, std::vector<head_t>, decltype(greater)> heads{greater};
+	for (std::size_t i = 0; i < readers.size(); ++i)
+		if (!readers[i].done())
+			heads.emplace(*readers[i], i);
+
+	std::vector<T> out_buf;
+	out_buf.reserve(buf_size);
+	while (!heads.empty()) {
+		auto i = heads.top().second;
+		out_buf.push_back(heads.top().first);
+		heads.pop();
+		if (!(++readers[i]).done())
+			heads.emplace(*readers[i], i);
+		if (out_buf.size() == buf_size) {
+			detail::write_all(out.get(), out_buf.data(), out_buf.size());
+			out_buf.clear();
+		}
+	}
+	detail::write_all(out.get(), out_buf.data(), out_buf.size());
+	if (std::fflush(out.get()))
+		throw std::runtime_error{"AVL: failed to write " + out_path};
+	return n;
+}
+
+// Read-only rank index over a sorted binary file of T (as written by external_sort).
+// Only the first element of every page stays in memory; pages are read on demand
+// and at most max_pages of them are cached.
+template <typename T>
+class AVL_sorted_file_t final {
+	static_assert(std::is_trivially_copyable_v<T>);
+	using page_t = std::vector<T>;
+	std::string path_;
+	int fd_;
+	std::size_t size_;
+	std::size_t page_elems_;
+	std::size_t max_pages_;
+	std::vector<T> fences_;
+	mutable std::list<std::pair<std::size_t, page_t>> lru_;
+	mutable std::unordered_map<std::size_t, typename decltype(lru_)::iterator> pages_;
+
+	void read(std::size_t first, std::size_t n, T *data) const;
+	const page_t &page(std::size_t i) const;
+
+	public:
+	AVL_sorted_file_t(const std::string &path, std::size_t page_elems = 1024, std::size_t max_pages = 1024);
+	AVL_sorted_file_t(const AVL_sorted_file_t &other) = delete;
+	AVL_sorted_file_t &operator = (const AVL_sorted_file_t &rhs) = delete;
+	~AVL_sorted_file_t() {
+		close(fd_);
+	}
+	std::size_t size() const {
+		return size_;
+	}
+	// n starts from 1 as in AVL_tree_t::get_nth
+	T get_nth(std::size_t n) const {
+		assert(n && n <= size_);
+		return page((n - 1) / page_elems_)[(n - 1) % page_elems_];
+	}
+	std::size_t count_less(const T &elem) const;
+	std::size_t count_greater(const T &elem) const;
+	std::size_t range_query(const std::pair<T, T> &query) const {
+		assert(!(query.second < query.first));
+		return size_ - count_less(query.first) - count_greater(query.second);
+	}
+	// builds a balanced in-memory tree of the whole file in O(n)
+	void load(AVL_set_t<T> &set, std::size_t buf_size = 1 << 16) const {
+		detail::file_ptr file{std::fopen(path_.c_str(), "rb"), &std::fclose};
+		if (!file)
+			throw std::runtime_error{"AVL: failed to open " + path_};
+		set.assign_sorted(detail::run_reader_t<T>{file.get(), buf_size}, size_);
+	}
+};
+
+template <typename T>
+AVL_sorted_file_t<T>::AVL_sorted_file_t(const std::string &path, std::size_t page_elems, std::size_t max_pages) :
+	path_(path), fd_(open(path.c_str(), O_RDONLY)), page_elems_(page_elems), max_pages_(max_pages)
+{
+	assert(page_elems && max_pages);
+	if (fd_ < 0)
+		throw std::runtime_error{"AVL: failed to open " + path};
+	auto bytes = lseek(fd_, 0, SEEK_END);
+	if (bytes < 0) {
+		close(fd_);
+		throw std::runtime_error{"AVL: failed to stat " + path};
+	}
+	size_ = bytes / sizeof(T);
+	fences_.resize((size_ + page_elems_ - 1) / page_elems_);
+	for (std::size_t i = 0; i < fences_.size(); ++i)
+		read(i * page_elems_, 1, &fences_[i]);
+}
+
+template <typename T>
+void AVL_sorted_file_t<T>::read(std::size_t first, std::size_t n, T *data) const {
+	auto bytes = n * sizeof(T);
+	auto dst = reinterpret_cast<char *>(data);
+	auto offset = static_cast<off_t>(first * sizeof(T));
+	while (bytes) {
+		auto res = pread(fd_, dst, bytes, offset);
+		if (res <= 0)
+			throw std::runtime_error{"AVL: failed to read " + path_};
+		bytes -= res;
+		dst += res;
+		offset += res;
+	}
+}
+
+template <typename T>
+const typename AVL_sorted_file_t<T>::page_t &AVL_sorted_file_t<T>::page(std::size_t i) const {
+	auto it = pages_.find(i);
+	if (it != pages_.end()) {
+		lru_.splice(lru_.begin(), lru_, it->second);
+		return it->second->second;
+	}
+	page_t data;
+	if (pages_.size() == max_pages_) {
+		data = std::move(lru_.back().second);
+		pages_.erase(lru_.back().first);
+		lru_.pop_back();
+	}
+	data.resize(std::min(page_elems_, size_ - i * page_elems_));
+	read(i * page_elems_, data.size(), data.data());
+	lru_.emplace_front(i, std::move(data));
+	pages_.emplace(i, lru_.begin());
+	return lru_.front().second;
+}
+
+template <typename T>
+std::size_t AVL_sorted_file_t<T>::count_less(const T &elem) const {
+	std::size_t p = std::lower_bound(fences_.begin(), fences_.end(), elem) - fences_.begin();
+	if (!p)
+		return 0;
+	auto &last = page(p - 1);
+	return (p - 1) * page_elems_ + (std::lower_bound(last.begin(), last.end(), elem) - last.begin());
+}
+
+template <typename T>
+std::size_t AVL_sorted_file_t<T>::count_greater(const T &elem) const {
+	std::size_t p = std::upper_bound(fences_.begin(), fences_.end(), elem) - fences_.begin();
+	if (!p)
+		return size_;
+	auto &last = page(p - 1);
+	return size_ - (p - 1) * page_elems_ - (std::upper_bound(last.begin(), last.end(), elem) - last.begin());
+}
+} //namespace AVL
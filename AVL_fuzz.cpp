@@ -0,0 +1,273 @@
+// Differential fuzzer of AVL_set_t (in strict and relaxed mode) against std::multiset.
+// Build with clang++ -fsanitize=fuzzer -DLIBFUZZER for libFuzzer; otherwise main() runs
+// the files given as arguments (or stdin for "-", as AFL does) or, without arguments,
+// a fixed number of random inputs. Per operation latency is reported at exit.
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "AVL_set.hpp"
+
+namespace {
+using T = int;
+using node_t = AVL::AVL_tree_t<T>;
+
+#define FUZZ_CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			std::cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #cond << std::endl; \
+			std::abort(); \
+		} \
+	} while (0)
+
+enum op_t { INSERT, ERASE, COUNT_LESS, GET_NTH, RANGE_QUERY, NTH_IN_RANGE, COPY, MOVE, CLEAR, RELAX, COMPACT, N_OPS };
+const char *op_names[N_OPS] = {"insert", "erase", "count_less", "get_nth", "range_query", "nth_in_range", "copy", "move", "clear", "relax", "compact"};
+
+// log-linear histogram: 16 buckets per power of two, so the memory is fixed however long
+// libFuzzer runs and the reported percentiles are upper bounds within 1/16
+struct histogram_t {
+	static constexpr int sub_bits = 4;
+	static constexpr long subs = 1L << sub_bits;
+	std::array<std::size_t, 64 * subs> buckets{};
+	std::size_t count = 0;
+	std::size_t over = 0;
+	long max = 0;
+
+	static std::size_t bucket(long ns) {
+		if (ns < subs)
+			return ns;
+		int e = 63 - __builtin_clzl(ns);
+		return (e - sub_bits + 1) * subs + ((ns >> (e - sub_bits)) & (subs - 1));
+	}
+	static long upper(std::size_t i) {
+		if (i < static_cast<std::size_t>(subs))
+			return i;
+		int e = i / subs + sub_bits - 1;
+		return ((subs + i % subs + 1) << (e - sub_bits)) - 1;
+	}
+	void add(long ns, long budget_ns) {
+		ns = std::max(ns, 0L);
+		buckets[bucket(ns)]++;
+		count++;
+		over += ns > budget_ns;
+		max = std::max(max, ns);
+	}
+	long percentile(std::size_t rank) const {
+		std::size_t seen = 0;
+		for (std::size_t i = 0; i < buckets.size(); ++i)
+			if ((seen += buckets[i]) > rank)
+				return std::min(upper(i), max);
+		return max;
+	}
+};
+
+struct latency_t {
+	histogram_t hists[N_OPS];
+	long budget_ns = 100000;
+	latency_t() {
+		if (auto budget = std::getenv("AVL_FUZZ_BUDGET_NS"))
+			budget_ns = std::atol(budget);
+	}
+	void add(op_t op, long ns) {
+		hists[op].add(ns, budget_ns);
+	}
+	~latency_t() {
+		std::cerr << "op            count     p50,ns     p99,ns     max,ns  over " << budget_ns << "ns" << std::endl;
+		for (auto op = 0; op < N_OPS; ++op) {
+			auto &h = hists[op];
+			if (!h.count)
+				continue;
+			std::fprintf(stderr, "%-12s %6zu %10ld %10ld %10ld %6zu\n", op_names[op], h.count,
+				     h.percentile(h.count / 2), h.percentile(h.count * 99 / 100), h.max, h.over);
+		}
+	}
+} latency;
+
+// checks h_dif_ (unless the set is in relaxed mode), size_ and parent_ of the subtree and returns its height
+int check_node(const node_t *node, const node_t *parent, bool relaxed) {
+	if (!node)
+		return 0;
+	FUZZ_CHECK(node->get_parent() == parent);
+	auto lheight = check_node(node->get_left(), node, relaxed);
+	auto rheight = check_node(node->get_right(), node, relaxed);
+	if (!relaxed) {
+		FUZZ_CHECK(node->get_h_dif() == lheight - rheight);
+		FUZZ_CHECK(node->get_h_dif() >= -1 && node->get_h_dif() <= 1);
+	}
+	FUZZ_CHECK(node->get_size() == node->get_lsize() + node->get_rsize() + 1);
+	return std::max(lheight, rheight) + 1;
+}
+
+void check_set(const AVL::AVL_set_t<T> &set, const std::multiset<T> &model) {
+	check_node(set.get_root(), nullptr, set.is_relaxed());
+	FUZZ_CHECK(set.size() == model.size());
+	auto node = set.min();
+	for (auto elem : model) {
+		FUZZ_CHECK(node && node->get_val() == elem);
+		node = node->next();
+	}
+	FUZZ_CHECK(!node);
+}
+
+class input_t {
+	const std::uint8_t *data_;
+	std::size_t size_;
+
+	public:
+	input_t(const std::uint8_t *data, std::size_t size) : data_(data), size_(size) {}
+	bool empty() const {
+		return !size_;
+	}
+	std::uint8_t byte() {
+		if (!size_)
+			return 0;
+		size_--;
+		return *data_++;
+	}
+	// small key range so that duplicates are common
+	T key() {
+		return static_cast<std::int8_t>(byte());
+	}
+};
+
+void run_op(op_t op, input_t &in, AVL::AVL_set_t<T> &set, std::multiset<T> &model) {
+	switch (op) {
+		case INSERT: {
+			auto key = in.key();
+			set.insert(key);
+			model.insert(key);
+			break;
+		}
+		case ERASE: {
+			auto key = in.key();
+			set.erase(key);
+			auto it = model.find(key);
+			if (it != model.end())
+				model.erase(it);
+			break;
+		}
+		case COUNT_LESS: {
+			auto key = in.key();
+			FUZZ_CHECK(set.count_less(key) == std::size_t(std::distance(model.begin(), model.lower_bound(key))));
+			FUZZ_CHECK(set.count_greater(key) == std::size_t(std::distance(model.upper_bound(key), model.end())));
+			break;
+		}
+		case GET_NTH: {
+			if (model.empty())
+				break;
+			auto n = in.byte() % model.size() + 1;
+			FUZZ_CHECK(set.get_root()->get_nth(n)->get_val() == *std::next(model.begin(), n - 1));
+			break;
+		}
+		case RANGE_QUERY: {
+			auto lo = in.key();
+			auto hi = in.key();
+			if (hi < lo)
+				std::swap(lo, hi);
+			FUZZ_CHECK(set.range_query({lo, hi}) == std::size_t(std::distance(model.lower_bound(lo), model.upper_bound(hi))));
+			break;
+		}
+		case NTH_IN_RANGE: {
+			auto lo = in.key();
+			auto hi = in.key();
+			std::size_t k = in.byte() % 8;
+			if (hi < lo)
+				std::swap(lo, hi);
+			auto first = model.lower_bound(lo);
+			auto last = model.upper_bound(hi);
+			auto node = set.nth_in_range(lo, hi, k);
+			if (!k || std::size_t(std::distance(first, last)) < k)
+				FUZZ_CHECK(!node);
+			else
+				FUZZ_CHECK(node && node->get_val() == *std::next(first, k - 1));
+			break;
+		}
+		case COPY: {
+			AVL::AVL_set_t<T> copy{set};
+			check_set(copy, model);
+			copy.insert(0);
+			set = copy;
+			set.erase(0);
+			break;
+		}
+		case MOVE: {
+			AVL::AVL_set_t<T> moved{std::move(set)};
+			check_set(moved, model);
+			set = std::move(moved);
+			break;
+		}
+		case CLEAR:
+			// rare, otherwise sets never grow
+			if (in.byte() < 4) {
+				set.clear();
+				model.clear();
+			}
+			break;
+		case RELAX:
+			set.set_relaxed(!set.is_relaxed());
+			break;
+		case COMPACT: {
+			// slices are left unfinished for the following operations to interrupt
+			std::size_t budget = in.byte() % 16;
+			if (budget == 15)
+				set.compact();
+			else
+				set.compact_step(budget);
+			break;
+		}
+		default:
+			break;
+	}
+}
+} //namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size) {
+	input_t in{data, size};
+	AVL::AVL_set_t<T> set;
+	std::multiset<T> model;
+	while (!in.empty()) {
+		auto op = static_cast<op_t>(in.byte() % N_OPS);
+		auto beg = std::chrono::steady_clock::now();
+		run_op(op, in, set, model);
+		auto end = std::chrono::steady_clock::now();
+		latency.add(op, std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count());
+		check_set(set, model);
+	}
+	return 0;
+}
+
+#ifndef LIBFUZZER
+int main(int argc, char **argv) {
+	std::vector<std::uint8_t> data;
+	if (argc == 1) {
+		std::default_random_engine e;
+		std::uniform_int_distribution<int> distr{0, 255};
+		for (auto i = 0; i < 200; ++i) {
+			data.resize(4096);
+			for (auto &byte : data)
+				byte = distr(e);
+			LLVMFuzzerTestOneInput(data.data(), data.size());
+		}
+		return 0;
+	}
+	for (auto i = 1; i < argc; ++i) {
+		std::string name = argv[i];
+		std::ifstream file;
+		if (name != "-")
+			file.open(name, std::ios::binary);
+		std::istream &in = (name == "-") ? std::cin : file;
+		data.assign(std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{});
+		LLVMFuzzerTestOneInput(data.data(), data.size());
+	}
+}
+#endif
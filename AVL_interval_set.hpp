@@ -0,0 +1,120 @@
+#pragma once
+#include "AVL_set.hpp"
+#include <cassert>
+#include <utility>
+#include <vector>
+
+namespace AVL
+{
+// Closed interval [lo, hi] ordered by (lo, hi); max_hi is maintained by the tree
+// and holds the largest hi in the node's subtree
+template <typename K>
+struct interval_t {
+	K lo;
+	K hi;
+	K max_hi;
+	interval_t(const K &lo_, const K &hi_) : lo(lo_), hi(hi_), max_hi(hi_) {}
+};
+
+template <typename K>
+bool operator < (const interval_t<K> &lhs, const interval_t<K> &rhs) {
+	return lhs.lo < rhs.lo || (!(rhs.lo < lhs.lo) && lhs.hi < rhs.hi);
+}
+template <typename K>
+bool operator > (const interval_t<K> &lhs, const interval_t<K> &rhs) {
+	return rhs < lhs;
+}
+template <typename K>
+bool operator == (const interval_t<K> &lhs, const interval_t<K> &rhs) {
+	return !(lhs < rhs) && !(rhs < lhs);
+}
+
+template <typename K>
+struct augment_traits<interval_t<K>> {
+	static constexpr bool enabled = true;
+	static void update(interval_t<K> &val, const interval_t<K> *left, const interval_t<K> *right) {
+		val.max_hi = val.hi;
+		if (left && val.max_hi < left->max_hi)
+			val.max_hi = left->max_hi;
+		if (right && val.max_hi < right->max_hi)
+			val.max_hi = right->max_hi;
+	}
+};
+
+// Multiset of closed intervals. Intervals are keyed on start with a max-end augmentation
+// for enumeration; a second tree of ends makes overlap counting two rank descents.
+template <typename K>
+class AVL_interval_set_t final {
+	using node_t = AVL_tree_t<interval_t<K>>;
+	AVL_set_t<interval_t<K>> starts_;
+	AVL_set_t<K> ends_;
+
+	public:
+	std::size_t size() const {
+		return starts_.size();
+	}
+	bool empty() const {
+		return starts_.empty();
+	}
+	const AVL_set_t<interval_t<K>> &get_set() const {
+		return starts_;
+	}
+	void insert(const K &lo, const K &hi) {
+		assert(!(hi < lo));
+		starts_.insert({lo, hi});
+		ends_.insert(hi);
+	}
+	void erase(const K &lo, const K &hi) {
+		if (!starts_.get_root() || !starts_.get_root()->search({lo, hi}))
+			return;
+		starts_.erase({lo, hi});
+		ends_.erase(hi);
+	}
+	// number of intervals intersecting [lo, hi] in O(log n)
+	std::size_t count_overlaps(const K &lo, const K &hi) const {
+		assert(!(hi < lo));
+		// intervals starting after hi, whatever their end
+		std::size_t starting_after = 0;
+		for (auto node = starts_.get_root(); node;) {
+			if (hi < node->get_val().lo) {
+				starting_after += node->get_rsize() + 1;
+				node = node->get_left();
+			}
+			else
+				node = node->get_right();
+		}
+		return size() - starting_after - ends_.count_less(lo);
+	}
+	std::size_t count_containing(const K &point) const {
+		return count_overlaps(point, point);
+	}
+	// writes the intervals intersecting [lo, hi] as pairs in ascending order in O(log n + k*log(n/k)):
+	// the walk prunes subtrees on max_hi, but reported nodes are not contiguous in the tree, so
+	// each of them may cost a descent (a centered interval tree would give O(log n + k))
+	template <typename OutputIt>
+	OutputIt overlaps(const K &lo, const K &hi, OutputIt out) const;
+};
+
+template <typename K>
+template <typename OutputIt>
+OutputIt AVL_interval_set_t<K>::overlaps(const K &lo, const K &hi, OutputIt out) const {
+	assert(!(hi < lo));
+	std::vector<const node_t *> nodes;
+	auto node = starts_.get_root();
+	while (true) {
+		for (; node && !(node->get_val().max_hi < lo); node = node->get_left())
+			nodes.push_back(node);
+		if (nodes.empty())
+			break;
+		node = nodes.back();
+		nodes.pop_back();
+		auto val = node->get_val();
+		if (hi < val.lo)
+			break;
+		if (!(val.hi < lo))
+			*out++ = std::pair<K, K>{val.lo, val.hi};
+		node = node->get_right();
+	}
+	return out;
+}
+} //namespace AVL
@@ -0,0 +1,405 @@
+#pragma once
+#include "AVL_set.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace AVL
+{
+namespace detail
+{
+inline int bit_width(std::uint64_t x) {
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+// Directory entry of a block, ordered by its first and then its last key: blocks sharing
+// a first key hold only that key except for the last of them, which this order keeps last.
+// keys is maintained by the tree and sums count over the node's subtree.
+template <typename T>
+struct packed_entry_t {
+	T first;
+	T last;
+	std::uint32_t block;
+	std::uint16_t count;
+	std::size_t keys;
+	packed_entry_t(const T &first_, const T &last_, std::uint32_t block_, std::uint16_t count_) :
+		first(first_), last(last_), block(block_), count(count_), keys(count_) {}
+};
+
+template <typename T>
+bool operator < (const packed_entry_t<T> &lhs, const packed_entry_t<T> &rhs) {
+	return lhs.first < rhs.first || (!(rhs.first < lhs.first) && lhs.last < rhs.last);
+}
+template <typename T>
+bool operator > (const packed_entry_t<T> &lhs, const packed_entry_t<T> &rhs) {
+	return rhs < lhs;
+}
+template <typename T>
+bool operator == (const packed_entry_t<T> &lhs, const packed_entry_t<T> &rhs) {
+	return !(lhs < rhs) && !(rhs < lhs);
+}
+} //namespace detail
+
+template <typename T>
+struct augment_traits<detail::packed_entry_t<T>> {
+	static constexpr bool enabled = true;
+	static void update(detail::packed_entry_t<T> &val, const detail::packed_entry_t<T> *left, const detail::packed_entry_t<T> *right) {
+		val.keys = val.count + (left ? left->keys : 0) + (right ? right->keys : 0);
+	}
+};
+
+// Ordered multiset of integers with the rank queries of AVL_set_t, stored in sorted blocks
+// of up to max_block keys. A block keeps key i as base + i * step + residual(i), where step
+// is its average gap and the residuals are bit-packed at the width of the largest one, so
+// evenly spaced keys take no bits at all and any key is decoded in O(1). The block directory
+// is an AVL_set_t of entries that sums key counts over subtrees, so finding the block of a key
+// or a rank takes O(log n), and so does updating it when blocks change, split or merge.
+// Updates re-encode one or two blocks in O(max_block).
+template <typename T>
+class AVL_packed_set_t final {
+	static_assert(std::is_integral_v<T> && sizeof(T) <= sizeof(std::uint64_t));
+
+	struct block_t {
+		std::uint64_t base = 0;
+		std::uint64_t step = 0;
+		std::vector<std::uint64_t> bits;
+		std::uint16_t count = 0;
+		std::uint8_t width = 0;
+
+		T get(std::size_t i) const {
+			std::uint64_t residual = 0;
+			if (width) {
+				auto pos = i * width;
+				auto word = pos / 64, shift = pos % 64;
+				residual = bits[word] >> shift;
+				if (shift + width > 64)
+					residual |= bits[word + 1] << (64 - shift);
+				if (width < 64)
+					residual &= (std::uint64_t{1} << width) - 1;
+			}
+			return static_cast<T>(base + i * step + residual);
+		}
+		void decode(std::vector<T> &keys) const {
+			keys.resize(count);
+			for (std::size_t i = 0; i < count; ++i)
+				keys[i] = get(i);
+		}
+		void encode(const T *keys, std::size_t n);
+		// rank in the block of the first key not less (upper: greater) than elem
+		std::size_t lower_bound(const T &elem) const;
+		std::size_t upper_bound(const T &elem) const;
+	};
+
+	using entry_t = detail::packed_entry_t<T>;
+	using node_t = AVL_tree_t<entry_t>;
+
+	// blocks are never moved once placed: released ones are reused through free_
+	std::vector<block_t> blocks_;
+	std::vector<std::uint32_t> free_;
+	AVL_set_t<entry_t> dir_;
+	std::size_t size_ = 0;
+	std::vector<T> keys_;
+
+	static std::size_t keys(const node_t *node) {
+		return node ? node->get_val().keys : 0;
+	}
+	entry_t entry(std::uint32_t b) const {
+		auto &block = blocks_[b];
+		return {block.get(0), block.get(block.count - 1), b, block.count};
+	}
+	std::uint32_t new_block() {
+		if (free_.empty()) {
+			blocks_.emplace_back();
+			return blocks_.size() - 1;
+		}
+		auto b = free_.back();
+		free_.pop_back();
+		return b;
+	}
+	void release_block(std::uint32_t b) {
+		blocks_[b] = block_t{};
+		free_.push_back(b);
+	}
+	// last block starting below elem (or not above it, if or_equal), before is the number
+	// of keys in the blocks in front of it
+	const node_t *find_block(const T &elem, bool or_equal, std::size_t &before) const;
+	// block holding the element with 0-based rank n, n is turned into its rank in the block
+	const node_t *find_nth(std::size_t &n) const;
+	void erase_nth(std::size_t n);
+
+	public:
+	static constexpr std::size_t max_block = 256;
+
+	AVL_packed_set_t() = default;
+	template <typename InputIt>
+	AVL_packed_set_t(InputIt first, InputIt last) {
+		for (; first != last; first++)
+			insert(*first);
+	}
+	// elements in [first, first + n) must be sorted
+	template <typename InputIt>
+	void assign_sorted(InputIt first, std::size_t n);
+
+	std::size_t size() const {
+		return size_;
+	}
+	bool empty() const {
+		return !size_;
+	}
+	void clear() {
+		*this = AVL_packed_set_t{};
+	}
+	T min() const {
+		assert(size_);
+		return dir_.min()->get_val().first;
+	}
+	T max() const {
+		assert(size_);
+		return dir_.max()->get_val().last;
+	}
+	std::size_t count_less(const T &elem) const {
+		// duplicates of elem may span blocks, so take the last block starting below it
+		std::size_t before = 0;
+		auto node = find_block(elem, false, before);
+		if (!node)
+			return 0;
+		return before + blocks_[node->get_val().block].lower_bound(elem);
+	}
+	std::size_t count_greater(const T &elem) const {
+		if (!size_)
+			return 0;
+		std::size_t before = 0;
+		auto node = find_block(elem, true, before);
+		if (!node)
+			return size_;
+		return size_ - before - blocks_[node->get_val().block].upper_bound(elem);
+	}
+	// rank of elem: number of lesser elements
+	std::size_t order(const T &elem) const {
+		return count_less(elem);
+	}
+	bool contains(const T &elem) const {
+		auto n = count_less(elem);
+		return n < size_ && get_nth(n + 1) == elem;
+	}
+	// n starts from 1 as in AVL_tree_t::get_nth
+	T get_nth(std::size_t n) const {
+		assert(n && n <= size_);
+		n--;
+		auto node = find_nth(n);
+		return blocks_[node->get_val().block].get(n);
+	}
+	std::size_t range_query(const std::pair<T, T> &query) const {
+		assert(!(query.second < query.first));
+		return size_ - count_less(query.first) - count_greater(query.second);
+	}
+	void insert(const T &elem);
+	void erase(const T &elem) {
+		auto n = count_less(elem);
+		if (n < size_ && get_nth(n + 1) == elem)
+			erase_nth(n);
+	}
+	// heap bytes in use, for comparison with the size of AVL_tree_t nodes
+	std::size_t bytes() const {
+		auto res = sizeof(*this) + blocks_.capacity() * sizeof(block_t) + free_.capacity() * sizeof(std::uint32_t) +
+			   dir_.size() * sizeof(node_t);
+		for (auto &block : blocks_)
+			res += block.bits.capacity() * sizeof(std::uint64_t);
+		return res;
+	}
+};
+
+template <typename T>
+void AVL_packed_set_t<T>::block_t::encode(const T *keys, std::size_t n) {
+	assert(n && n <= max_block);
+	count = n;
+	auto first = static_cast<std::uint64_t>(keys[0]);
+	auto range = static_cast<std::uint64_t>(keys[n - 1]) - first;
+	// deviations from the line through both ends fit in int64 only below 2^62
+	step = (n > 1 && range < (std::uint64_t{1} << 62)) ? range / (n - 1) : 0;
+	std::int64_t min_dev = 0;
+	if (step)
+		for (std::size_t i = 0; i < n; ++i)
+			min_dev = std::min(min_dev, static_cast<std::int64_t>(static_cast<std::uint64_t>(keys[i]) - first - i * step));
+	base = first + min_dev;
+	std::uint64_t max_residual = 0;
+	for (std::size_t i = 0; i < n; ++i)
+		max_residual = std::max(max_residual, static_cast<std::uint64_t>(keys[i]) - base - i * step);
+	width = detail::bit_width(max_residual);
+	bits.assign((n * width + 63) / 64, 0);
+	bits.shrink_to_fit();
+	if (!width)
+		return;
+	for (std::size_t i = 0; i < n; ++i) {
+		auto residual = static_cast<std::uint64_t>(keys[i]) - base - i * step;
+		auto pos = i * width;
+		auto word = pos / 64, shift = pos % 64;
+		bits[word] |= residual << shift;
+		if (shift + width > 64)
+			bits[word + 1] |= residual >> (64 - shift);
+	}
+}
+
+template <typename T>
+std::size_t AVL_packed_set_t<T>::block_t::lower_bound(const T &elem) const {
+	std::size_t first = 0, n = count;
+	while (n) {
+		auto half = n / 2;
+		if (get(first + half) < elem) {
+			first += half + 1;
+			n -= half + 1;
+		}
+		else
+			n = half;
+	}
+	return first;
+}
+
+template <typename T>
+std::size_t AVL_packed_set_t<T>::block_t::upper_bound(const T &elem) const {
+	std::size_t first = 0, n = count;
+	while (n) {
+		auto half = n / 2;
+		if (!(elem < get(first + half))) {
+			first += half + 1;
+			n -= half + 1;
+		}
+		else
+			n = half;
+	}
+	return first;
+}
+
+template <typename T>
+auto AVL_packed_set_t<T>::find_block(const T &elem, bool or_equal, std::size_t &before) const -> const node_t * {
+	const node_t *res = nullptr;
+	std::size_t skipped = 0;
+	for (auto node = dir_.get_root(); node;) {
+		auto val = node->get_val();
+		if (val.first < elem || (or_equal && !(elem < val.first))) {
+			res = node;
+			before = skipped + keys(node->get_left());
+			skipped = before + val.count;
+			node = node->get_right();
+		}
+		else
+			node = node->get_left();
+	}
+	return res;
+}
+
+template <typename T>
+auto AVL_packed_set_t<T>::find_nth(std::size_t &n) const -> const node_t * {
+	auto node = dir_.get_root();
+	while (true) {
+		auto lkeys = keys(node->get_left());
+		if (n < lkeys) {
+			node = node->get_left();
+			continue;
+		}
+		n -= lkeys;
+		auto count = node->get_val().count;
+		if (n < count)
+			return node;
+		n -= count;
+		node = node->get_right();
+	}
+}
+
+template <typename T>
+template <typename InputIt>
+void AVL_packed_set_t<T>::assign_sorted(InputIt first, std::size_t n) {
+	clear();
+	blocks_.reserve((n + max_block - 1) / max_block);
+	std::vector<entry_t> entries;
+	entries.reserve(blocks_.capacity());
+	for (std::size_t done = 0; done < n;) {
+		keys_.clear();
+		for (; done < n && keys_.size() < max_block; ++done, ++first)
+			keys_.push_back(*first);
+		blocks_.emplace_back();
+		blocks_.back().encode(keys_.data(), keys_.size());
+		entries.push_back(entry(blocks_.size() - 1));
+	}
+	size_ = n;
+	dir_.assign_sorted(entries.begin(), entries.size());
+}
+
+// equal elements go after the present ones as in AVL_tree_t::insert
+template <typename T>
+void AVL_packed_set_t<T>::insert(const T &elem) {
+	size_++;
+	if (dir_.empty()) {
+		auto b = new_block();
+		blocks_[b].encode(&elem, 1);
+		dir_.insert(entry(b));
+		return;
+	}
+	std::size_t before = 0;
+	auto node = find_block(elem, true, before);
+	if (!node)
+		node = dir_.min();
+	auto b = node->get_val().block;
+	blocks_[b].decode(keys_);
+	keys_.insert(keys_.begin() + blocks_[b].upper_bound(elem), elem);
+	if (keys_.size() <= max_block) {
+		blocks_[b].encode(keys_.data(), keys_.size());
+		dir_.replace_node(node, entry(b));
+		return;
+	}
+	auto half = keys_.size() / 2;
+	auto upper = new_block();
+	blocks_[b].encode(keys_.data(), half);
+	blocks_[upper].encode(keys_.data() + half, keys_.size() - half);
+	dir_.replace_node(node, entry(b));
+	dir_.insert(entry(upper));
+}
+
+// a block falling below max_block / 4 keys is merged into a neighbour (and split again if too big)
+template <typename T>
+void AVL_packed_set_t<T>::erase_nth(std::size_t n) {
+	size_--;
+	auto node = find_nth(n);
+	auto b = node->get_val().block;
+	blocks_[b].decode(keys_);
+	keys_.erase(keys_.begin() + n);
+	if (keys_.size() >= max_block / 4 || dir_.size() == 1) {
+		if (keys_.empty()) {
+			clear();
+			return;
+		}
+		blocks_[b].encode(keys_.data(), keys_.size());
+		dir_.replace_node(node, entry(b));
+		return;
+	}
+	// lower and upper are the directory nodes of the merged blocks in key order
+	std::vector<T> merged;
+	const node_t *lower = node, *upper = node->next();
+	if (upper) {
+		blocks_[upper->get_val().block].decode(merged);
+		merged.insert(merged.begin(), keys_.begin(), keys_.end());
+	}
+	else {
+		upper = node;
+		lower = node->prev();
+		blocks_[lower->get_val().block].decode(merged);
+		merged.insert(merged.end(), keys_.begin(), keys_.end());
+	}
+	auto lb = lower->get_val().block, ub = upper->get_val().block;
+	if (merged.size() <= max_block) {
+		blocks_[lb].encode(merged.data(), merged.size());
+		dir_.erase_node(upper);
+		release_block(ub);
+		dir_.replace_node(lower, entry(lb));
+		return;
+	}
+	auto half = merged.size() / 2;
+	blocks_[lb].encode(merged.data(), half);
+	blocks_[ub].encode(merged.data() + half, merged.size() - half);
+	dir_.replace_node(lower, entry(lb));
+	dir_.replace_node(upper, entry(ub));
+}
+} //namespace AVL
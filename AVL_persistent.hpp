@@ -0,0 +1,284 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <deque>
+#include <utility>
+
+namespace AVL
+{
+// Immutable AVL multiset shared between versions: insert and erase copy the O(log n) nodes
+// on the search path and share the rest with the version they started from. Nodes are
+// reference counted and freed once no version uses them; counts are not atomic, so versions
+// sharing nodes may be queried concurrently but created and dropped only by one thread.
+template <typename T>
+class AVL_snapshot_t final {
+	struct node_t {
+		T val;
+		const node_t *left;
+		const node_t *right;
+		std::size_t size;
+		mutable std::size_t refs = 1;
+		signed char height;
+		// takes over the references to left and right
+		node_t(const T &elem, const node_t *left_, const node_t *right_) :
+			val(elem), left(left_), right(right_),
+			size(get_size(left_) + get_size(right_) + 1),
+			height(std::max(get_height(left_), get_height(right_)) + 1)
+		{}
+	};
+	const node_t *root_ = nullptr;
+
+	explicit AVL_snapshot_t(const node_t *root) : root_(root) {}
+	static std::size_t get_size(const node_t *node) {
+		return node ? node->size : 0;
+	}
+	static int get_height(const node_t *node) {
+		return node ? node->height : 0;
+	}
+	static const node_t *retain(const node_t *node) {
+		if (node)
+			node->refs++;
+		return node;
+	}
+	static void release(const node_t *node) {
+		while (node && !--node->refs) {
+			release(node->left);
+			auto right = node->right;
+			delete node;
+			node = right;
+		}
+	}
+	static const node_t *balance(const T &elem, const node_t *left, const node_t *right);
+	static const node_t *insert(const node_t *node, const T &elem);
+	static const node_t *erase(const node_t *node, const T &elem, bool &found);
+	static const node_t *erase_min(const node_t *node, const T *&min);
+
+	public:
+	AVL_snapshot_t() = default;
+	// versions are shared in O(1)
+	AVL_snapshot_t(const AVL_snapshot_t &other) : root_(retain(other.root_)) {}
+	AVL_snapshot_t &operator = (const AVL_snapshot_t &rhs) {
+		retain(rhs.root_);
+		release(root_);
+		root_ = rhs.root_;
+		return *this;
+	}
+	AVL_snapshot_t(AVL_snapshot_t &&other) noexcept {
+		std::swap(root_, other.root_);
+	}
+	AVL_snapshot_t &operator = (AVL_snapshot_t &&other) noexcept {
+		std::swap(root_, other.root_);
+		return *this;
+	}
+	~AVL_snapshot_t() {
+		release(root_);
+	}
+
+	// new versions, this one is left unchanged
+	AVL_snapshot_t insert(const T &elem) const {
+		return AVL_snapshot_t{insert(root_, elem)};
+	}
+	AVL_snapshot_t erase(const T &elem) const {
+		bool found = false;
+		auto root = erase(root_, elem, found);
+		return found ? AVL_snapshot_t{root} : *this;
+	}
+
+	bool empty() const {
+		return !root_;
+	}
+	std::size_t size() const {
+		return get_size(root_);
+	}
+	int get_height() const {
+		return get_height(root_);
+	}
+	bool contains(const T &elem) const;
+	// rank of elem: number of lesser elements
+	std::size_t order(const T &elem) const {
+		return count_less(elem);
+	}
+	std::size_t count_less(const T &elem) const;
+	std::size_t count_greater(const T &elem) const;
+	std::size_t range_query(const std::pair<T, T> &query) const {
+		assert(!(query.second < query.first));
+		return size() - count_less(query.first) - count_greater(query.second);
+	}
+	// n starts from 1 as in AVL_tree_t::get_nth
+	const T &get_nth(std::size_t n) const;
+};
+
+// links elem between left and right, whose heights differ by at most two, rotating once
+// or twice if needed; takes over the references to left and right
+template <typename T>
+auto AVL_snapshot_t<T>::balance(const T &elem, const node_t *left, const node_t *right) -> const node_t * {
+	auto lheight = get_height(left);
+	auto rheight = get_height(right);
+	if (lheight > rheight + 1) {
+		const node_t *res;
+		if (get_height(left->left) >= get_height(left->right))
+			res = new node_t(left->val, retain(left->left), new node_t(elem, retain(left->right), right));
+		else {
+			auto mid = left->right;
+			res = new node_t(mid->val, new node_t(left->val, retain(left->left), retain(mid->left)),
+					 new node_t(elem, retain(mid->right), right));
+		}
+		release(left);
+		return res;
+	}
+	if (rheight > lheight + 1) {
+		const node_t *res;
+		if (get_height(right->right) >= get_height(right->left))
+			res = new node_t(right->val, new node_t(elem, left, retain(right->left)), retain(right->right));
+		else {
+			auto mid = right->left;
+			res = new node_t(mid->val, new node_t(elem, left, retain(mid->left)),
+					 new node_t(right->val, retain(mid->right), retain(right->right)));
+		}
+		release(right);
+		return res;
+	}
+	return new node_t(elem, left, right);
+}
+
+// equal elements go to the right as in AVL_tree_t::insert
+template <typename T>
+auto AVL_snapshot_t<T>::insert(const node_t *node, const T &elem) -> const node_t * {
+	if (!node)
+		return new node_t(elem, nullptr, nullptr);
+	if (elem < node->val)
+		return balance(node->val, insert(node->left, elem), retain(node->right));
+	return balance(node->val, retain(node->left), insert(node->right, elem));
+}
+
+// removes one element equal to elem; nothing is allocated and nullptr is returned if there is none
+template <typename T>
+auto AVL_snapshot_t<T>::erase(const node_t *node, const T &elem, bool &found) -> const node_t * {
+	if (!node)
+		return nullptr;
+	if (elem < node->val) {
+		auto left = erase(node->left, elem, found);
+		return found ? balance(node->val, left, retain(node->right)) : nullptr;
+	}
+	if (node->val < elem) {
+		auto right = erase(node->right, elem, found);
+		return found ? balance(node->val, retain(node->left), right) : nullptr;
+	}
+	found = true;
+	if (!node->right)
+		return retain(node->left);
+	const T *min;
+	auto right = erase_min(node->right, min);
+	return balance(*min, retain(node->left), right);
+}
+
+// min points to the removed value, in a node of the version erase started from
+template <typename T>
+auto AVL_snapshot_t<T>::erase_min(const node_t *node, const T *&min) -> const node_t * {
+	if (!node->left) {
+		min = &node->val;
+		return retain(node->right);
+	}
+	return balance(node->val, erase_min(node->left, min), retain(node->right));
+}
+
+template <typename T>
+bool AVL_snapshot_t<T>::contains(const T &elem) const {
+	auto node = root_;
+	while (node) {
+		if (elem < node->val)
+			node = node->left;
+		else if (node->val < elem)
+			node = node->right;
+		else
+			return true;
+	}
+	return false;
+}
+
+template <typename T>
+std::size_t AVL_snapshot_t<T>::count_less(const T &elem) const {
+	std::size_t res = 0;
+	for (auto node = root_; node;) {
+		if (node->val < elem) {
+			res += get_size(node->left) + 1;
+			node = node->right;
+		}
+		else
+			node = node->left;
+	}
+	return res;
+}
+
+template <typename T>
+std::size_t AVL_snapshot_t<T>::count_greater(const T &elem) const {
+	std::size_t res = 0;
+	for (auto node = root_; node;) {
+		if (elem < node->val) {
+			res += get_size(node->right) + 1;
+			node = node->left;
+		}
+		else
+			node = node->right;
+	}
+	return res;
+}
+
+template <typename T>
+const T &AVL_snapshot_t<T>::get_nth(std::size_t n) const {
+	assert(n && n <= size());
+	auto node = root_;
+	while (true) {
+		auto n_notmore = get_size(node->left) + 1;
+		if (n == n_notmore)
+			return node->val;
+		if (n < n_notmore)
+			node = node->left;
+		else {
+			n -= n_notmore;
+			node = node->right;
+		}
+	}
+}
+
+// History of a multiset: every update creates a numbered version, starting from the empty
+// version 0. Old versions stay queryable until dropped; dropping frees the nodes that no
+// later version shares, so memory follows the O(log n) nodes copied per retained update.
+template <typename T>
+class AVL_versioned_set_t final {
+	std::deque<AVL_snapshot_t<T>> versions_;
+	std::size_t oldest_ = 0;
+
+	public:
+	AVL_versioned_set_t() : versions_(1) {}
+	std::size_t version() const {
+		return oldest_ + versions_.size() - 1;
+	}
+	std::size_t oldest() const {
+		return oldest_;
+	}
+	const AVL_snapshot_t<T> &at(std::size_t version) const {
+		assert(version >= oldest_ && version <= this->version());
+		return versions_[version - oldest_];
+	}
+	const AVL_snapshot_t<T> &current() const {
+		return versions_.back();
+	}
+	// both return the number of the new version
+	std::size_t insert(const T &elem) {
+		versions_.push_back(current().insert(elem));
+		return version();
+	}
+	std::size_t erase(const T &elem) {
+		versions_.push_back(current().erase(elem));
+		return version();
+	}
+	// forgets the versions before version; the current one is always kept
+	void drop_before(std::size_t version) {
+		version = std::min(version, this->version());
+		for (; oldest_ < version; ++oldest_)
+			versions_.pop_front();
+	}
+};
+} //namespace AVL
@@ -0,0 +1,360 @@
+#pragma once
+#include "AVL_set.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace AVL
+{
+// Binary protocol: fixed size requests answered in order with one 64-bit word each,
+// all in host byte order since both ends share the machine
+enum query_op_t : std::uint32_t { COUNT_LESS, COUNT_GREATER, GET_NTH, RANGE_QUERY };
+
+struct query_t {
+	std::uint32_t op;
+	std::int32_t first;
+	std::int32_t second;
+};
+
+constexpr std::uint64_t bad_query = UINT64_MAX;
+
+namespace detail
+{
+inline sockaddr_un unix_address(const std::string &path) {
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error{"AVL: socket path is too long: " + path};
+	std::strcpy(addr.sun_path, path.c_str());
+	return addr;
+}
+
+inline void check(bool ok, const char *what) {
+	if (!ok)
+		throw std::runtime_error{std::string{"AVL: "} + what + ": " + std::strerror(errno)};
+}
+} //namespace detail
+
+inline std::uint64_t answer(const AVL_set_t<std::int32_t> &set, const query_t &query) {
+	switch (query.op) {
+		case COUNT_LESS:
+			return set.count_less(query.first);
+		case COUNT_GREATER:
+			return set.count_greater(query.first);
+		case GET_NTH:
+			if (query.first <= 0 || static_cast<std::size_t>(query.first) > set.size())
+				return bad_query;
+			return static_cast<std::uint32_t>(set.get_root()->get_nth(query.first)->get_val());
+		case RANGE_QUERY:
+			if (query.second < query.first)
+				return 0;
+			return set.range_query({query.first, query.second});
+		default:
+			return bad_query;
+	}
+}
+
+// Answers queries against a set that is not modified while the server runs.
+// Every epoll wakeup reads all complete requests from all ready connections into one
+// batch, answers it (split between threads if it is large) and writes the replies back.
+// A connection whose replies do not fit in its socket is not read until they are sent,
+// so a client that pipelines without reading is throttled by its own socket buffers.
+// A client may shut down its writing end after the last request: what was read is still
+// answered, and the connection is closed once the replies are sent.
+class AVL_query_server_t final {
+	struct conn_t {
+		std::vector<char> in;
+		std::vector<char> out;
+		std::size_t out_pos = 0;
+		bool blocked = false;
+		bool eof = false;
+	};
+	struct pending_t {
+		int fd;
+		query_t query;
+	};
+
+	const AVL_set_t<std::int32_t> &set_;
+	std::string path_;
+	unsigned threads_;
+	int listen_fd_ = -1;
+	int epoll_fd_ = -1;
+	std::unordered_map<int, conn_t> conns_;
+	std::vector<pending_t> batch_;
+	std::vector<std::uint64_t> answers_;
+	std::size_t batches_ = 0;
+
+	void watch(int fd, std::uint32_t events, int op) {
+		epoll_event ev{};
+		ev.events = events;
+		ev.data.fd = fd;
+		detail::check(!epoll_ctl(epoll_fd_, op, fd, &ev), "epoll_ctl");
+	}
+	void accept_all();
+	void read_all(int fd);
+	void flush(int fd);
+	void close_conn(int fd);
+	void answer_batch();
+
+	public:
+	static constexpr std::size_t parallel_batch = 4096;
+
+	AVL_query_server_t(const AVL_set_t<std::int32_t> &set, const std::string &path, unsigned threads = 1);
+	AVL_query_server_t(const AVL_query_server_t &other) = delete;
+	AVL_query_server_t &operator = (const AVL_query_server_t &rhs) = delete;
+	~AVL_query_server_t();
+
+	// waits up to timeout_ms for requests and serves what arrived
+	void poll(int timeout_ms);
+	void run(const std::atomic<bool> &stop) {
+		while (!stop.load(std::memory_order_relaxed))
+			poll(100);
+	}
+	std::size_t batches() const {
+		return batches_;
+	}
+	// reply bytes answered but not yet sent
+	std::size_t pending_output() const {
+		std::size_t bytes = 0;
+		for (auto &conn : conns_)
+			bytes += conn.second.out.size() - conn.second.out_pos;
+		return bytes;
+	}
+};
+
+inline AVL_query_server_t::AVL_query_server_t(const AVL_set_t<std::int32_t> &set, const std::string &path, unsigned threads) :
+	set_(set), path_(path), threads_(threads ? threads : 1)
+{
+	auto addr = detail::unix_address(path);
+	unlink(path.c_str());
+	listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	detail::check(listen_fd_ >= 0, "socket");
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(listen_fd_, SOMAXCONN)) {
+		auto err = errno;
+		close(listen_fd_);
+		if (epoll_fd_ >= 0)
+			close(epoll_fd_);
+		errno = err;
+		detail::check(false, "failed to listen on socket");
+	}
+	watch(listen_fd_, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+inline AVL_query_server_t::~AVL_query_server_t() {
+	for (auto &conn : conns_)
+		close(conn.first);
+	close(listen_fd_);
+	close(epoll_fd_);
+	unlink(path_.c_str());
+}
+
+inline void AVL_query_server_t::poll(int timeout_ms) {
+	epoll_event events[64];
+	auto n = epoll_wait(epoll_fd_, events, 64, timeout_ms);
+	if (n < 0 && errno == EINTR)
+		return;
+	detail::check(n >= 0, "epoll_wait");
+	for (auto i = 0; i < n; ++i) {
+		auto fd = events[i].data.fd;
+		if (fd == listen_fd_)
+			accept_all();
+		// EPOLLOUT is only watched while replies are blocked; a hangup then comes with it
+		// and is noticed by the failing send rather than by reading an end that was already read
+		else if (events[i].events & EPOLLOUT)
+			flush(fd);
+		else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			read_all(fd);
+	}
+	if (batch_.empty())
+		return;
+	answer_batch();
+	for (std::size_t i = 0; i < batch_.size(); ++i) {
+		auto &out = conns_.at(batch_[i].fd).out;
+		auto answer = reinterpret_cast<const char *>(&answers_[i]);
+		out.insert(out.end(), answer, answer + sizeof(std::uint64_t));
+	}
+	// one connection appears in the batch once per request, flush each only once
+	for (std::size_t i = 0; i < batch_.size(); ++i)
+		if (!i || batch_[i].fd != batch_[i - 1].fd)
+			flush(batch_[i].fd);
+	batch_.clear();
+	batches_++;
+}
+
+inline void AVL_query_server_t::accept_all() {
+	while (true) {
+		auto fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		conns_.emplace(fd, conn_t{});
+		watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+	}
+}
+
+inline void AVL_query_server_t::read_all(int fd) {
+	auto it = conns_.find(fd);
+	if (it == conns_.end())
+		return;
+	auto &conn = it->second;
+	auto &in = conn.in;
+	char buf[1 << 16];
+	bool failed = false;
+	while (!conn.eof) {
+		auto res = read(fd, buf, sizeof(buf));
+		if (res > 0) {
+			in.insert(in.end(), buf, buf + res);
+			continue;
+		}
+		if (!res) {
+			conn.eof = true;
+			break;
+		}
+		if (errno == EINTR)
+			continue;
+		failed = errno != EAGAIN && errno != EWOULDBLOCK;
+		break;
+	}
+	auto n = in.size() / sizeof(query_t);
+	for (std::size_t i = 0; i < n; ++i) {
+		pending_t pending{fd, {}};
+		std::memcpy(&pending.query, in.data() + i * sizeof(query_t), sizeof(query_t));
+		batch_.push_back(pending);
+	}
+	in.erase(in.begin(), in.begin() + n * sizeof(query_t));
+	if (failed) {
+		// drop requests of the broken connection that were just added
+		while (!batch_.empty() && batch_.back().fd == fd)
+			batch_.pop_back();
+		close_conn(fd);
+	}
+	else if (conn.eof) {
+		// nothing more to read: close now if no replies are due, otherwise after flush() sends them
+		if (!n && conn.out_pos == conn.out.size())
+			close_conn(fd);
+		else
+			watch(fd, conn.blocked ? std::uint32_t{EPOLLOUT} : 0, EPOLL_CTL_MOD);
+	}
+}
+
+inline void AVL_query_server_t::answer_batch() {
+	answers_.resize(batch_.size());
+	auto answer_range = [this](std::size_t first, std::size_t last) {
+		for (auto i = first; i < last; ++i)
+			answers_[i] = answer(set_, batch_[i].query);
+	};
+	if (threads_ < 2 || batch_.size() < parallel_batch) {
+		answer_range(0, batch_.size());
+		return;
+	}
+	std::vector<std::future<void>> parts;
+	auto chunk = (batch_.size() + threads_ - 1) / threads_;
+	for (std::size_t first = chunk; first < batch_.size(); first += chunk)
+		parts.push_back(std::async(std::launch::async, answer_range, first, std::min(first + chunk, batch_.size())));
+	answer_range(0, chunk);
+	for (auto &part : parts)
+		part.get();
+}
+
+inline void AVL_query_server_t::flush(int fd) {
+	auto it = conns_.find(fd);
+	if (it == conns_.end())
+		return;
+	auto &conn = it->second;
+	while (conn.out_pos < conn.out.size()) {
+		auto res = send(fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (!conn.blocked)
+				watch(fd, EPOLLOUT, EPOLL_CTL_MOD);
+			conn.blocked = true;
+			return;
+		}
+		if (res < 0) {
+			close_conn(fd);
+			return;
+		}
+		conn.out_pos += res;
+	}
+	if (conn.eof) {
+		close_conn(fd);
+		return;
+	}
+	conn.out.clear();
+	conn.out_pos = 0;
+	if (conn.blocked)
+		watch(fd, EPOLLIN, EPOLL_CTL_MOD);
+	conn.blocked = false;
+}
+
+inline void AVL_query_server_t::close_conn(int fd) {
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	conns_.erase(fd);
+}
+
+// Blocking client; send() may be called several times before the matching receive()
+class AVL_query_client_t final {
+	int fd_;
+
+	public:
+	explicit AVL_query_client_t(const std::string &path) {
+		auto addr = detail::unix_address(path);
+		fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		detail::check(fd_ >= 0, "socket");
+		if (connect(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+			auto err = errno;
+			close(fd_);
+			errno = err;
+			detail::check(false, "connect");
+		}
+	}
+	AVL_query_client_t(const AVL_query_client_t &other) = delete;
+	AVL_query_client_t &operator = (const AVL_query_client_t &rhs) = delete;
+	~AVL_query_client_t() {
+		close(fd_);
+	}
+	void send(const query_t *queries, std::size_t n) {
+		auto data = reinterpret_cast<const char *>(queries);
+		auto bytes = n * sizeof(query_t);
+		while (bytes) {
+			auto res = ::send(fd_, data, bytes, MSG_NOSIGNAL);
+			if (res < 0 && errno == EINTR)
+				continue;
+			detail::check(res > 0, "send");
+			data += res;
+			bytes -= res;
+		}
+	}
+	void receive(std::uint64_t *answers, std::size_t n) {
+		auto data = reinterpret_cast<char *>(answers);
+		auto bytes = n * sizeof(std::uint64_t);
+		while (bytes) {
+			auto res = read(fd_, data, bytes);
+			if (res < 0 && errno == EINTR)
+				continue;
+			detail::check(res > 0, "read");
+			data += res;
+			bytes -= res;
+		}
+	}
+	std::uint64_t query(const query_t &query) {
+		std::uint64_t res;
+		send(&query, 1);
+		receive(&res, 1);
+		return res;
+	}
+};
+} //namespace AVL
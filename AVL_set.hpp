@@ -1,28 +1,192 @@
 #pragma once
 #include "AVL_tree.hpp"
+#include "AVL_arena.hpp"
+#include <algorithm>
 #include <cassert>
-#include <queue>
-#include <stack>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace AVL
 {
+namespace detail
+{
+constexpr std::size_t parallel_grain = 1 << 15;
+
+template <typename RandomIt>
+void parallel_sort(RandomIt first, RandomIt last, unsigned threads) {
+	std::size_t n = last - first;
+	if (threads < 2 || n < parallel_grain) {
+		std::sort(first, last);
+		return;
+	}
+	auto mid = first + n / 2;
+	auto left = std::async(std::launch::async, parallel_sort<RandomIt>, first, mid, threads / 2);
+	parallel_sort(mid, last, threads - threads / 2);
+	left.get();
+	std::inplace_merge(first, mid, last);
+}
+
+// in-order walk over node values, usable as InputIt of AVL_tree_t::build_sorted
+template <typename T>
+class value_iterator_t final {
+	const AVL_tree_t<T> *node_;
+
+	public:
+	explicit value_iterator_t(const AVL_tree_t<T> *node) : node_(node) {}
+	T operator * () const {
+		return node_->get_val();
+	}
+	value_iterator_t &operator ++ () {
+		node_ = node_->next();
+		return *this;
+	}
+};
+} //namespace detail
+
+// Resumable in-order scan over the elements in [lo, hi] of a tree that is not modified
+// meanwhile. Ancestors still to be visited stay on an explicit stack, so each element
+// costs O(1) amortized and a page of results continues where the previous one stopped.
+template <typename T>
+class AVL_range_cursor_t final {
+	std::vector<const AVL_tree_t<T> *> stack_;
+	// counted upfront, so the scan needs no comparisons
+	std::size_t left_ = 0;
+
+	public:
+	AVL_range_cursor_t(const AVL_tree_t<T> *root, const T &lo, const T &hi) {
+		assert(!(hi < lo));
+		if (!root)
+			return;
+		left_ = root->get_size() - root->count_less(lo) - root->count_greater(hi);
+		// the lower_bound path: nodes not less than lo whose left subtree comes first
+		for (auto node = root; left_ && node;) {
+			if (node->get_val() < lo)
+				node = node->get_right();
+			else {
+				stack_.push_back(node);
+				node = node->get_left();
+			}
+		}
+	}
+	bool done() const {
+		return !left_;
+	}
+	// writes up to n next elements to out and returns the end of the written range
+	template <typename OutputIt>
+	OutputIt read(OutputIt out, std::size_t n) {
+		n = std::min(n, left_);
+		left_ -= n;
+		for (; n; --n) {
+			auto node = stack_.back();
+			stack_.pop_back();
+			*out++ = node->get_val();
+			for (node = node->get_right(); node; node = node->get_left())
+				stack_.push_back(node);
+		}
+		if (!left_)
+			stack_.clear();
+		return out;
+	}
+};
+
 template <typename T>
 class AVL_set_t final {
+	// state of compact_step, allocated by the first one and freed with the last one,
+	// unless the set moved from the global heap into an arena of its own that it keeps
+	struct compaction_t {
+		std::unique_ptr<AVL_arena_t> own_storage;
+		// a compaction is under way and holds a reserve of the storage
+		bool active = false;
+		// the set is being moved from the global heap into own_storage: until it is done,
+		// nodes own_storage has not reserved are still on the heap
+		bool moving_heap = false;
+		// BFS queue of compacted nodes whose children compact_step still has to check
+		std::vector<AVL_tree_t<T> *> queue;
+		std::size_t head = 0;
+	};
+	// a set on the global heap with fewer bytes of nodes moves to an arena of normal pages
+	static constexpr std::size_t own_huge_pages_from = detail::huge_page;
+
 	AVL_tree_t<T> *root_ = nullptr;
+	AVL_storage_t *storage_ = nullptr;
+	std::unique_ptr<compaction_t> compaction_;
+	bool relaxed_ = false;
 	void copy_tree(const AVL_set_t &other);
 	void delete_tree();
+	// after a modification the walk starts over, but nodes already moved stay where they are
+	void restart_compacting() {
+		if (compaction_) {
+			compaction_->queue.clear();
+			compaction_->head = 0;
+		}
+	}
+	// once no node is left on the global heap
+	void stop_compacting() {
+		if (!compaction_)
+			return;
+		if (compaction_->active)
+			storage_->reserve(sizeof(AVL_tree_t<T>), 0);
+		if (!compaction_->own_storage) {
+			compaction_.reset();
+			return;
+		}
+		restart_compacting();
+		compaction_->active = compaction_->moving_heap = false;
+	}
+	bool owns_storage() const {
+		return compaction_ && compaction_->own_storage;
+	}
+	bool relocate(std::size_t budget, AVL_storage_t *from);
+	// the storage node was allocated from
+	AVL_storage_t *storage_of(const AVL_tree_t<T> *node) const {
+		return (compaction_ && compaction_->moving_heap && !storage_->reserved(node)) ? nullptr : storage_;
+	}
+	// spare, if given, is an unlinked node reused for elem
+	void insert_spare(const T &elem, AVL_tree_t<T> *spare) {
+		restart_compacting();
+		if (relaxed_)
+			root_ = AVL_tree_t<T>::insert_relaxed(elem, root_, spare, storage_);
+		else
+			root_ = AVL_tree_t<T>::insert(elem, root_, spare, storage_);
+	}
+	template <typename RandomIt>
+	static AVL_tree_t<T> *build_parallel(RandomIt first, std::size_t n, unsigned threads);
 	
 	public:
 	AVL_set_t() = default;
+	// nodes are placed in storage, which must outlive the set
+	explicit AVL_set_t(AVL_storage_t *storage) : storage_(storage) {}
 	template <typename InputIt>
 	AVL_set_t(InputIt first, InputIt last) {
 		for (; first != last; first++)
 		       insert(*first);
 	}
-	AVL_set_t(const AVL_set_t &other) : AVL_set_t(){
+	// sorts a copy of [first, last) and links the tree with up to threads threads
+	template <typename InputIt>
+	AVL_set_t(InputIt first, InputIt last, unsigned threads) {
+		std::vector<T> elems(first, last);
+		detail::parallel_sort(elems.begin(), elems.end(), threads);
+		root_ = build_parallel(elems.begin(), elems.size(), threads);
+	}
+	// elements in [first, first + n) must be sorted
+	template <typename InputIt>
+	void assign_sorted(InputIt first, std::size_t n) {
+		delete_tree();
+		root_ = AVL_tree_t<T>::build_sorted(first, n, nullptr, storage_);
+	}
+	AVL_set_t(const AVL_set_t &other) : AVL_set_t(other.owns_storage() ? nullptr : other.storage_) {
 		copy_tree(other);	
 	}
+	// copy placed in another storage, e.g. a read-only replica in an arena local to
+	// the NUMA node of the threads that query it
+	AVL_set_t(const AVL_set_t &other, AVL_storage_t *storage) : AVL_set_t(storage) {
+		copy_tree(other);
+	}
 	AVL_set_t &operator = (const AVL_set_t &rhs) {
 		if (rhs.root_ != root_) {
 			delete_tree();
@@ -30,11 +194,16 @@ class AVL_set_t final {
 		}
 		return *this;
 	}
-	AVL_set_t(AVL_set_t &&other) : AVL_set_t() {
-		std::swap(root_, other.root_);
+	AVL_set_t(AVL_set_t &&other) noexcept : AVL_set_t() {
+		*this = std::move(other);
 	}
-	AVL_set_t &operator = (AVL_set_t &&other) {
+	AVL_set_t &operator = (AVL_set_t &&other) noexcept {
 		std::swap(root_, other.root_);
+		std::swap(storage_, other.storage_);
+		// a compaction goes on where it stopped, it only depends on the nodes and the storage
+		std::swap(compaction_, other.compaction_);
+		std::swap(relaxed_, other.relaxed_);
+		return *this;
 	}
 	~AVL_set_t() {
 		delete_tree();
@@ -42,18 +211,69 @@ class AVL_set_t final {
 	const AVL_tree_t<T> *get_root() const {
 		return root_;
 	}
+	AVL_storage_t *get_storage() const {
+		return storage_;
+	}
 	void insert(const T &elem) {
-		root_ = root_->insert(elem, root_);
+		insert_spare(elem, nullptr);
 	}
 	void erase(const T &elem) {
 		if (!root_)
 			return;
 		auto node = root_->search(elem);
-		root_ = node->delete_node(root_);
+		if (node) {
+			restart_compacting();
+			root_ = node->delete_node(root_, !relaxed_, storage_of(node));
+		}
+	}
+	// moves the node storing old_elem to new_elem without reallocating it
+	void replace(const T &old_elem, const T &new_elem) {
+		auto node = root_ ? root_->search(old_elem) : nullptr;
+		if (node)
+			replace_node(node, new_elem);
+		else
+			insert(new_elem);
 	}
-	bool empty() {
+	// Node-level updates for callers that keep the nodes of their elements, e.g. AVL_window_t,
+	// and so skip the search. Nodes stay valid until erased; only compaction moves them.
+	const AVL_tree_t<T> *insert_node(const T &elem) {
+		auto node = AVL_tree_t<T>::create(elem, nullptr, storage_);
+		insert_spare(elem, node);
+		return node;
+	}
+	void erase_node(const AVL_tree_t<T> *node) {
+		restart_compacting();
+		root_ = const_cast<AVL_tree_t<T> *>(node)->delete_node(root_, !relaxed_, storage_of(node));
+	}
+	const AVL_tree_t<T> *replace_node(const AVL_tree_t<T> *node, const T &new_elem) {
+		restart_compacting();
+		auto spare = const_cast<AVL_tree_t<T> *>(node)->detach_node(root_, !relaxed_);
+		insert_spare(new_elem, spare);
+		return spare;
+	}
+	// In relaxed mode updates skip AVL rotations for write bursts; size_ stays exact, so
+	// rank queries keep working. Leaving it repairs the paths the burst touched in one pass.
+	// It pays off on insert/erase churn over a large tree; filling an empty one is slower
+	// than in strict mode, as its paths grow longer than AVL ones.
+	void set_relaxed(bool relaxed) {
+		if (relaxed_ && !relaxed && root_) {
+			restart_compacting();
+			root_ = root_->repair(root_);
+		}
+		relaxed_ = relaxed;
+	}
+	bool is_relaxed() const {
+		return relaxed_;
+	}
+	void clear() {
+		delete_tree();
+	}
+	bool empty() const {
 		return !root_;
 	}
+	std::size_t size() const {
+		return root_ ? root_->get_size() : 0;
+	}
 	const AVL_tree_t<T> *min() const {
 		if (root_)
 			return root_->min();
@@ -64,45 +284,185 @@ class AVL_set_t final {
 			return root_->max();
 		return nullptr;
 	}
-	std::size_t range_query(const std::pair<T, T> &query) {
-		return  root_->order(query.second) - root_->order(query.first) + (root_->search(query.second) ? 1 : 0);
+	std::size_t range_query(const std::pair<T, T> &query) const {
+		assert(!(query.second < query.first));
+		return size() - count_less(query.first) - count_greater(query.second);
+	}
+	std::size_t count_less(const T &elem) const {
+		return root_ ? root_->count_less(elem) : 0;
+	}
+	std::size_t count_greater(const T &elem) const {
+		return root_ ? root_->count_greater(elem) : 0;
+	}
+	const AVL_tree_t<T> *nth_in_range(const T &lo, const T &hi, std::size_t k) const {
+		return root_ ? root_->nth_in_range(lo, hi, k) : nullptr;
+	}
+	AVL_range_cursor_t<T> cursor(const T &lo, const T &hi) const {
+		return {root_, lo, hi};
+	}
+	// writes the elements in [lo, hi] in ascending order
+	template <typename OutputIt>
+	OutputIt copy_range(const T &lo, const T &hi, OutputIt out) const {
+		return cursor(lo, hi).read(out, size());
+	}
+	// calls f(const T *data, std::size_t n) with consecutive chunks of up to chunk elements in [lo, hi]
+	template <typename F>
+	void for_each_range(const T &lo, const T &hi, F f, std::size_t chunk = 1024) const;
+	// Moves all nodes, in BFS order, to one contiguous run of the set's storage, so that the
+	// top levels share cache lines and pages, then returns freed memory to the system. Sets on
+	// the global heap are moved into an arena of their own first, where malloc cannot scatter them.
+	void compact() {
+		compact_step(std::numeric_limits<std::size_t>::max());
+	}
+	// the same in slices moving up to budget nodes, so queries and updates can run in between;
+	// returns true once finished. Nodes inserted meanwhile are placed with the moved ones, and
+	// an update only makes the next slice walk the moved nodes again. While a set leaves the
+	// global heap, a node is freed to the arena if the arena has reserved it, else to the heap.
+	// The arena of a set leaving the heap is sized to hold it in its first chunk.
+	bool compact_step(std::size_t budget) {
+		if (!compaction_)
+			compaction_ = std::make_unique<compaction_t>();
+		if (!storage_ && root_) {
+			auto bytes = size() * sizeof(AVL_tree_t<T>);
+			auto pages = (bytes < own_huge_pages_from) ? page_mode_t::normal : page_mode_t::transparent;
+			compaction_->own_storage = std::make_unique<AVL_arena_t>(pages, numa_policy_t::local, 0, 1 << 30, bytes);
+			storage_ = compaction_->own_storage.get();
+			compaction_->moving_heap = true;
+		}
+		return relocate(budget, compaction_->moving_heap ? nullptr : storage_);
+	}
+	// elements with ranks (number of lesser elements) in [first, last), as [begin, end) for next()
+	std::pair<const AVL_tree_t<T> *, const AVL_tree_t<T> *> slice(std::size_t first, std::size_t last) const {
+		assert(first <= last && last <= size());
+		if (first == last)
+			return {nullptr, nullptr};
+		return {root_->get_nth(first + 1), (last < size()) ? root_->get_nth(last + 1) : nullptr};
+	}
+	// nearest-rank quantile, q in [0, 1]
+	const AVL_tree_t<T> *quantile(double q) const {
+		assert(q >= 0 && q <= 1);
+		if (!root_)
+			return nullptr;
+		auto n = static_cast<std::size_t>(std::ceil(q * size()));
+		return root_->get_nth(n ? n : 1);
+	}
+	// lower median
+	const AVL_tree_t<T> *median() const {
+		if (!root_)
+			return nullptr;
+		return root_->get_nth((size() + 1) / 2);
 	}
 };
 
 template <typename T>
-void AVL_set_t<T>::copy_tree(const AVL_set_t &other) {
-	if (!other.root_)
-		return;
-	std::queue<const AVL_tree_t<T> *> nodes;
-	nodes.push(other.root_);
-	while (!nodes.empty()) {
-		auto node = nodes.front();
-		nodes.pop();
-		root_ = root_->insert(node->get_val(), root_);
-		if (node->left)
-			nodes.push(node->left);
-		if (node->right)
-			nodes.push(node->right);
+template <typename RandomIt>
+AVL_tree_t<T> *AVL_set_t<T>::build_parallel(RandomIt first, std::size_t n, unsigned threads) {
+	if (threads < 2 || n < detail::parallel_grain)
+		return AVL_tree_t<T>::build_sorted(first, n);
+	auto lsize = (n - 1) / 2;
+	auto left = std::async(std::launch::async, build_parallel<RandomIt>, first, lsize, threads / 2);
+	auto right = build_parallel(first + lsize + 1, n - lsize - 1, threads - threads / 2);
+	return AVL_tree_t<T>::join(left.get(), first[lsize], right);
+}
+
+template <typename T>
+template <typename F>
+void AVL_set_t<T>::for_each_range(const T &lo, const T &hi, F f, std::size_t chunk) const {
+	assert(chunk);
+	auto scan = cursor(lo, hi);
+	std::vector<T> buf(std::min(chunk, size()));
+	while (!scan.done()) {
+		auto n = scan.read(buf.data(), buf.size()) - buf.data();
+		f(static_cast<const T *>(buf.data()), static_cast<std::size_t>(n));
 	}
 }
 
 template <typename T>
-void AVL_set_t<T>::delete_tree() {
-	std::stack<AVL_tree_t<T> *> nodes;
-	nodes.push(nullptr);
-	auto node = root_;
-	while (node) {
-		auto left = node->get_left();
-		auto right = node->get_right();
-		if (!left && !right) {
-			node->delete_leaf(root_);
-			node = nodes.top();
-			nodes.pop();
+bool AVL_set_t<T>::relocate(std::size_t budget, AVL_storage_t *from) {
+	if (!root_) {
+		stop_compacting();
+		return true;
+	}
+	auto &state = *compaction_;
+	auto &queue = state.queue;
+	if (!state.active) {
+		storage_->reserve(sizeof(AVL_tree_t<T>), size());
+		state.active = true;
+	}
+	// only moves count against budget, and the children of a node are moved together,
+	// so a slice may take one node over budget
+	if (queue.empty()) {
+		if (!storage_->reserved(root_)) {
+			if (!budget)
+				return false;
+			root_->relocate(root_, from, storage_);
+			budget--;
+		}
+		queue.push_back(root_);
+	}
+	while (state.head < queue.size()) {
+		auto node = queue[state.head];
+		auto left = node->get_left(), right = node->get_right();
+		auto move_left = left && !storage_->reserved(left);
+		auto move_right = right && !storage_->reserved(right);
+		if ((move_left || move_right) && !budget)
+			return false;
+		state.head++;
+		if (move_left) {
+			left = left->relocate(root_, from, storage_);
+			budget--;
+		}
+		if (move_right) {
+			right = right->relocate(root_, from, storage_);
+			budget -= std::min<std::size_t>(budget, 1);
+		}
+		if (left)
+			queue.push_back(left);
+		if (right)
+			queue.push_back(right);
+		// drop the consumed head once it is most of the queue
+		if (state.head > 1024 && state.head > queue.size() / 2) {
+			queue.erase(queue.begin(), queue.begin() + state.head);
+			state.head = 0;
 		}
-		else {
-			nodes.push(node);
-			node = left ? left : right;
+	}
+	stop_compacting();
+	storage_->trim();
+	return true;
+}
+
+template <typename T>
+void AVL_set_t<T>::copy_tree(const AVL_set_t &other) {
+	if (other.root_)
+		assign_sorted(detail::value_iterator_t<T>{other.root_->min()}, other.size());
+}
+
+template <typename T>
+void AVL_set_t<T>::delete_tree() {
+	if (compaction_ && compaction_->moving_heap) {
+		// nodes are freed one by one while the reserve still tells where they are, and
+		// the set goes back to the heap it had not left yet
+		std::vector<AVL_tree_t<T> *> nodes;
+		if (root_)
+			nodes.push_back(root_);
+		while (!nodes.empty()) {
+			auto node = nodes.back();
+			nodes.pop_back();
+			if (node->get_left())
+				nodes.push_back(node->get_left());
+			if (node->get_right())
+				nodes.push_back(node->get_right());
+			AVL_tree_t<T>::destroy(node, storage_of(node));
 		}
+		root_ = nullptr;
+		compaction_.reset();
+		storage_ = nullptr;
+		return;
 	}
+	stop_compacting();
+	// nodes that need no destructor call go at once if the storage holds nothing else
+	if (!root_ || !storage_ || !std::is_trivially_destructible_v<T> || !storage_->release(size()))
+		AVL_tree_t<T>::delete_tree(root_, storage_);
+	root_ = nullptr;
 }
 } //namespace AVL
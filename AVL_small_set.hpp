@@ -0,0 +1,121 @@
+#pragma once
+#include "AVL_set.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <utility>
+
+namespace AVL
+{
+// Ordered multiset that keeps up to N elements in an inline sorted array and moves them
+// to an AVL_set_t only once it overflows. Lookups in the array are branchless linear scans.
+template <typename T, std::size_t N = 64>
+class AVL_small_set_t final {
+	static_assert(N > 1);
+	std::array<T, N> small_;
+	std::size_t size_ = 0;
+	AVL_set_t<T> tree_;
+
+	bool in_tree() const {
+		return !tree_.empty();
+	}
+	void promote();
+	void demote();
+
+	public:
+	AVL_small_set_t() = default;
+	template <typename InputIt>
+	AVL_small_set_t(InputIt first, InputIt last) {
+		for (; first != last; first++)
+			insert(*first);
+	}
+	std::size_t size() const {
+		return in_tree() ? tree_.size() : size_;
+	}
+	bool empty() const {
+		return !size();
+	}
+	std::size_t count_less(const T &elem) const {
+		if (in_tree())
+			return tree_.count_less(elem);
+		std::size_t res = 0;
+		for (std::size_t i = 0; i < size_; ++i)
+			res += small_[i] < elem;
+		return res;
+	}
+	std::size_t count_greater(const T &elem) const {
+		if (in_tree())
+			return tree_.count_greater(elem);
+		std::size_t res = 0;
+		for (std::size_t i = 0; i < size_; ++i)
+			res += elem < small_[i];
+		return res;
+	}
+	bool contains(const T &elem) const {
+		if (in_tree())
+			return tree_.get_root()->search(elem);
+		auto pos = count_less(elem);
+		return pos < size_ && !(elem < small_[pos]);
+	}
+	// n starts from 1 as in AVL_tree_t::get_nth
+	T get_nth(std::size_t n) const {
+		assert(n && n <= size());
+		if (in_tree())
+			return tree_.get_root()->get_nth(n)->get_val();
+		return small_[n - 1];
+	}
+	std::size_t range_query(const std::pair<T, T> &query) const {
+		assert(!(query.second < query.first));
+		return size() - count_less(query.first) - count_greater(query.second);
+	}
+	void insert(const T &elem);
+	void erase(const T &elem);
+};
+
+template <typename T, std::size_t N>
+void AVL_small_set_t<T, N>::insert(const T &elem) {
+	if (in_tree()) {
+		tree_.insert(elem);
+		return;
+	}
+	if (size_ == N) {
+		promote();
+		tree_.insert(elem);
+		return;
+	}
+	auto pos = size_ - count_greater(elem);
+	std::copy_backward(small_.begin() + pos, small_.begin() + size_, small_.begin() + size_ + 1);
+	small_[pos] = elem;
+	size_++;
+}
+
+template <typename T, std::size_t N>
+void AVL_small_set_t<T, N>::erase(const T &elem) {
+	if (in_tree()) {
+		tree_.erase(elem);
+		if (tree_.size() <= N / 2)
+			demote();
+		return;
+	}
+	auto pos = count_less(elem);
+	if (pos == size_ || elem < small_[pos])
+		return;
+	std::copy(small_.begin() + pos + 1, small_.begin() + size_, small_.begin() + pos);
+	size_--;
+}
+
+template <typename T, std::size_t N>
+void AVL_small_set_t<T, N>::promote() {
+	for (std::size_t i = 0; i < size_; ++i)
+		tree_.insert(small_[i]);
+	size_ = 0;
+}
+
+template <typename T, std::size_t N>
+void AVL_small_set_t<T, N>::demote() {
+	size_ = 0;
+	for (auto node = tree_.min(); node; node = node->next())
+		small_[size_++] = node->get_val();
+	tree_ = AVL_set_t<T>{};
+}
+} //namespace AVL
@@ -1,9 +1,23 @@
 #include <gtest/gtest.h>
 #include "AVL_set.hpp"
+#include "AVL_window.hpp"
+#include "AVL_small_set.hpp"
+#include "AVL_external.hpp"
+#include "AVL_interval_set.hpp"
+#include "AVL_server.hpp"
+#include "AVL_arena.hpp"
+#include "AVL_persistent.hpp"
+#include "AVL_packed_set.hpp"
+#include <thread>
 #include <vector>
 #include <list>
 #include <algorithm>
 #include <random>
+#include <limits>
+#include <iterator>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
 
 namespace {
 	using T = int;
@@ -45,6 +59,33 @@ TEST(SearchTree, CtorFromRange) {
 	}
 }
 
+TEST(SearchTree, Copy) {
+	std::vector<T> v{{4, 1, 3, 2, 5}};
+	AVL::AVL_set_t<T> set{v.begin(), v.end()};
+	AVL::AVL_set_t<T> copy{set};
+	set.erase(3);
+	std::sort(v.begin(), v.end());
+	auto el = copy.min();
+	for (auto i : v) {
+		EXPECT_EQ(el->get_val(), i);
+		el = el->next();
+	}
+	set = std::move(copy);
+	EXPECT_EQ(set.size(), v.size());
+}
+
+TEST(SearchTree, Clear) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_set_t<T> set;
+	for (auto i = 0; i < ksize; ++i)
+		set.insert(distr(e));
+	set.clear();
+	EXPECT_TRUE(set.empty());
+	set.insert(1);
+	EXPECT_EQ(set.size(), 1);
+}
+
 TEST(SearchTree, DeleteRootNoChildren) {
 	AVL::AVL_set_t<T> set;
 	set.insert(1);
@@ -139,6 +180,34 @@ TEST(AVLTree, Erase) {
 	EXPECT_TRUE(set.empty());
 }
 
+int height(const AVL::AVL_tree_t<T> *node) {
+	if (!node)
+		return 0;
+	auto lheight = height(node->get_left());
+	auto rheight = height(node->get_right());
+	EXPECT_EQ(node->get_h_dif(), lheight - rheight);
+	return std::max(lheight, rheight) + 1;
+}
+
+TEST(AVLTree, HeightDifference) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_set_t<T> set;
+	std::vector<T> v;
+	for (auto i = 0; i < 10 * ksize; ++i) {
+		if (v.empty() || distr(e) % 3) {
+			v.push_back(distr(e));
+			set.insert(v.back());
+		}
+		else {
+			auto pos = distr(e) % v.size();
+			set.erase(v[pos]);
+			v.erase(v.begin() + pos);
+		}
+		height(set.get_root());
+	}
+}
+
 TEST(RangeQuery, LowerBound) {
 	std::vector<T> v{{1, 2, 3, 5, 6}};
 	AVL::AVL_set_t<T> set{v.begin(), v.end()};
@@ -223,4 +292,892 @@ TEST(OrderStat, Order) {
 		 EXPECT_EQ(set.get_root()->order(i), i / 2);
 	EXPECT_EQ(set.get_root()->order(12), v.size());
 }
+
+TEST(OrderStat, CountLessGreater) {
+	std::vector<T> v{{1, 3, 3, 3, 5, 7}};
+	AVL::AVL_set_t<T> set{v.begin(), v.end()};
+	for (T i = 0; i < 9; ++i) {
+		EXPECT_EQ(set.count_less(i), std::lower_bound(v.begin(), v.end(), i) - v.begin());
+		EXPECT_EQ(set.count_greater(i), v.end() - std::upper_bound(v.begin(), v.end(), i));
+	}
+	EXPECT_EQ(set.range_query({3, 3}), 3);
+}
+
+TEST(OrderStat, NthInRange) {
+	std::vector<T> v{{1, 3, 5, 7, 9, 11}};
+	AVL::AVL_set_t<T> set{v.begin(), v.end()};
+	EXPECT_EQ(set.nth_in_range(4, 10, 1)->get_val(), 5);
+	EXPECT_EQ(set.nth_in_range(4, 10, 3)->get_val(), 9);
+	EXPECT_EQ(set.nth_in_range(4, 10, 4), nullptr);
+	EXPECT_EQ(set.nth_in_range(4, 8, 3), nullptr);
+	EXPECT_EQ(set.nth_in_range(4, 10, 0), nullptr);
+	EXPECT_EQ(set.nth_in_range(12, 20, 1), nullptr);
+	EXPECT_EQ(set.nth_in_range(6, 20, SIZE_MAX - 2), nullptr);
+}
+
+TEST(OrderStat, Slice) {
+	std::vector<T> v{{0, 1, 2, 3, 4, 5}};
+	AVL::AVL_set_t<T> set{v.begin(), v.end()};
+	auto [first, last] = set.slice(2, 5);
+	for (auto i = 2; i < 5; ++i) {
+		EXPECT_EQ(first->get_val(), i);
+		first = first->next();
+	}
+	EXPECT_EQ(first, last);
+	EXPECT_EQ(set.slice(3, 6).second, nullptr);
+}
+
+TEST(OrderStat, Quantile) {
+	AVL::AVL_set_t<T> set;
+	EXPECT_EQ(set.median(), nullptr);
+	for (auto i = 1; i <= 100; ++i)
+		set.insert(i);
+	EXPECT_EQ(set.median()->get_val(), 50);
+	EXPECT_EQ(set.quantile(0.9)->get_val(), 90);
+	EXPECT_EQ(set.quantile(0.99)->get_val(), 99);
+	EXPECT_EQ(set.quantile(0)->get_val(), 1);
+	EXPECT_EQ(set.quantile(1)->get_val(), 100);
+}
+
+TEST(Window, Evict) {
+	AVL::AVL_window_t<T> window{3};
+	for (auto i : {5, 1, 4, 2})
+		window.push(i);
+	EXPECT_EQ(window.size(), 3);
+	EXPECT_EQ(window.oldest(), 1);
+	EXPECT_EQ(window.median()->get_val(), 2);
+	window.evict();
+	EXPECT_EQ(window.oldest(), 4);
+	EXPECT_EQ(window.range_query({0, 10}), 2);
+	window.push(0);
+	window.push(7);
+	EXPECT_EQ(window.get_nth(1)->get_val(), 0);
+	EXPECT_EQ(window.get_nth(3)->get_val(), 7);
+}
+
+TEST(Window, CopyAndMove) {
+	AVL::AVL_window_t<T> window{3};
+	for (auto i : {5, 1, 4})
+		window.push(i);
+	auto copy = window;
+	// each window evicts its own oldest node
+	copy.push(9);
+	copy.push(8);
+	EXPECT_EQ(copy.oldest(), 4);
+	EXPECT_EQ(copy.get_nth(1)->get_val(), 4);
+	EXPECT_EQ(copy.get_nth(3)->get_val(), 9);
+	window.push(0);
+	EXPECT_EQ(window.oldest(), 1);
+	EXPECT_EQ(window.get_nth(1)->get_val(), 0);
+	copy = window;
+	EXPECT_EQ(copy.oldest(), 1);
+	copy.push(2);
+	EXPECT_EQ(copy.oldest(), 4);
+	EXPECT_EQ(window.oldest(), 1);
+
+	auto moved = std::move(window);
+	EXPECT_EQ(moved.oldest(), 1);
+	EXPECT_EQ(window.size(), 0);
+	EXPECT_EQ(window.capacity(), 0);
+	window.push(7);
+	EXPECT_TRUE(window.empty());
+	window = std::move(moved);
+	window.push(7);
+	EXPECT_EQ(window.oldest(), 4);
+	EXPECT_EQ(window.range_query({0, 10}), 3);
+}
+
+TEST(Window, EvictNth) {
+	AVL::AVL_window_t<T> window{4};
+	for (auto i : {5, 1, 4, 2, 6})
+		window.push(i);
+	// ring: 1 4 2 6, head past the start
+	window.evict_nth(2);
+	EXPECT_EQ(window.size(), 3);
+	EXPECT_EQ(window.oldest(), 1);
+	window.evict_nth(1);
+	EXPECT_EQ(window.oldest(), 4);
+	window.push(3);
+	window.push(8);
+	EXPECT_EQ(window.size(), 4);
+	window.push(0);
+	// 4 was the oldest of 4 6 3 8
+	EXPECT_EQ(window.oldest(), 6);
+	EXPECT_EQ(window.get_nth(1)->get_val(), 0);
+	EXPECT_EQ(window.range_query({0, 10}), 4);
+}
+
+TEST(Window, MatchesRecentKeys) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	constexpr std::size_t capacity = 10;
+	AVL::AVL_window_t<T> window{capacity};
+	std::vector<T> v;
+	for (auto i = 0; i < ksize; ++i) {
+		v.push_back(distr(e));
+		window.push(v.back());
+		std::vector<T> recent{v.end() - std::min(v.size(), capacity), v.end()};
+		std::sort(recent.begin(), recent.end());
+		auto el = window.get_set().min();
+		for (auto j : recent) {
+			EXPECT_EQ(el->get_val(), j);
+			el = el->next();
+		}
+		EXPECT_EQ(el, nullptr);
+	}
+}
+
+TEST(Window, NodesKeepValues) {
+	AVL::AVL_set_t<T> set;
+	std::vector<const AVL::AVL_tree_t<T> *> nodes;
+	for (auto i = 0; i < ksize; ++i)
+		nodes.push_back(set.insert_node(i));
+	std::default_random_engine e;
+	std::shuffle(nodes.begin(), nodes.end(), e);
+	// erasing inner nodes relinks the others rather than moving values between them
+	for (std::size_t i = 0; i < nodes.size() / 2; ++i)
+		set.erase_node(nodes[i]);
+	for (std::size_t i = nodes.size() / 2; i < nodes.size(); ++i)
+		nodes[i] = set.replace_node(nodes[i], nodes[i]->get_val() + ksize);
+	for (std::size_t i = nodes.size() / 2; i < nodes.size(); ++i)
+		EXPECT_EQ(set.get_root()->search(nodes[i]->get_val()), nodes[i]);
+	EXPECT_EQ(set.size(), nodes.size() - nodes.size() / 2);
+}
+
+TEST(SmallSet, Promotion) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_small_set_t<T, 8> set;
+	std::vector<T> v;
+	for (auto i = 0; i < ksize; ++i) {
+		if (v.empty() || distr(e) % 3) {
+			v.push_back(distr(e));
+			set.insert(v.back());
+		}
+		else {
+			auto pos = distr(e) % v.size();
+			set.erase(v[pos]);
+			v.erase(v.begin() + pos);
+		}
+		auto sorted = v;
+		std::sort(sorted.begin(), sorted.end());
+		ASSERT_EQ(set.size(), sorted.size());
+		for (auto j = 0u; j < sorted.size(); ++j)
+			EXPECT_EQ(set.get_nth(j + 1), sorted[j]);
+		auto key = distr(e);
+		EXPECT_EQ(set.count_less(key), std::lower_bound(sorted.begin(), sorted.end(), key) - sorted.begin());
+		EXPECT_EQ(set.contains(key), std::binary_search(sorted.begin(), sorted.end(), key));
+	}
+}
+
+TEST(SmallSet, RangeQuery) {
+	std::vector<T> v{{1, 2, 3, 5, 6}};
+	AVL::AVL_small_set_t<T> set{v.begin(), v.end()};
+	EXPECT_EQ(set.range_query({1, 6}), 5);
+	EXPECT_EQ(set.range_query({1, 4}), 3);
+	EXPECT_EQ(set.range_query({4, 4}), 0);
+	set.erase(4);
+	set.erase(5);
+	EXPECT_EQ(set.range_query({4, 6}), 1);
+}
+
+TEST(Build, AssignSorted) {
+	for (auto n = 0; n < 40; ++n) {
+		std::vector<T> v;
+		for (auto i = 0; i < n; ++i)
+			v.push_back(i / 2);
+		AVL::AVL_set_t<T> set;
+		set.insert(ksize);
+		set.assign_sorted(v.begin(), v.size());
+		EXPECT_EQ(set.size(), v.size());
+		height(set.get_root());
+		auto el = set.min();
+		for (auto i : v) {
+			EXPECT_EQ(el->get_val(), i);
+			EXPECT_EQ(el->get_size(), el->get_lsize() + el->get_rsize() + 1);
+			el = el->next();
+		}
+		set.insert(n);
+		set.erase(0);
+		height(set.get_root());
+	}
+}
+
+TEST(Build, ExternalSort) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	std::vector<T> v;
+	for (auto i = 0; i < 10 * ksize; ++i)
+		v.push_back(distr(e));
+	char path[] = "/tmp/avl_testXXXXXX";
+	close(mkstemp(path));
+	EXPECT_EQ(AVL::external_sort<T>(v.begin(), v.size(), path, 64, 16), v.size());
+	AVL::AVL_sorted_file_t<T> index{path, 32, 4};
+	AVL::AVL_set_t<T> set;
+	index.load(set);
+	unlink(path);
+
+	std::sort(v.begin(), v.end());
+	ASSERT_EQ(index.size(), v.size());
+	EXPECT_EQ(set.size(), v.size());
+	for (auto i = 0u; i < v.size(); i += 7) {
+		EXPECT_EQ(index.get_nth(i + 1), v[i]);
+		EXPECT_EQ(set.get_root()->get_nth(i + 1)->get_val(), v[i]);
+	}
+	for (auto i = -1; i <= ksize + 1; ++i) {
+		EXPECT_EQ(index.count_less(i), std::lower_bound(v.begin(), v.end(), i) - v.begin());
+		EXPECT_EQ(index.count_greater(i), v.end() - std::upper_bound(v.begin(), v.end(), i));
+		EXPECT_EQ(index.range_query({i, i + 10}), set.range_query({i, i + 10}));
+	}
+}
+
+TEST(Build, ExternalSortThreads) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, 1000 * ksize};
+	std::vector<T> v;
+	// runs above parallel_grain, so they are split between threads
+	for (std::size_t i = 0; i < 5 * AVL::detail::parallel_grain; ++i)
+		v.push_back(distr(e));
+	char path[] = "/tmp/avl_testXXXXXX";
+	close(mkstemp(path));
+	EXPECT_EQ(AVL::external_sort<T>(v.begin(), v.size(), path, 2 * AVL::detail::parallel_grain, 1024, 4), v.size());
+	AVL::AVL_sorted_file_t<T> index{path};
+	unlink(path);
+
+	std::sort(v.begin(), v.end());
+	ASSERT_EQ(index.size(), v.size());
+	for (auto i = 0u; i < v.size(); i += 101)
+		EXPECT_EQ(index.get_nth(i + 1), v[i]);
+}
+
+TEST(Build, Parallel) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, 1000 * ksize};
+	std::vector<T> v;
+	for (auto i = 0; i < 1000 * ksize; ++i)
+		v.push_back(distr(e));
+	AVL::AVL_set_t<T> set{v.begin(), v.end(), 4};
+	std::sort(v.begin(), v.end());
+	ASSERT_EQ(set.size(), v.size());
+	height(set.get_root());
+	auto el = set.min();
+	for (auto i : v) {
+		ASSERT_EQ(el->get_val(), i);
+		EXPECT_EQ(el->get_size(), el->get_lsize() + el->get_rsize() + 1);
+		if (el->get_left()) {
+			EXPECT_EQ(el->get_left()->get_parent(), el);
+		}
+		if (el->get_right()) {
+			EXPECT_EQ(el->get_right()->get_parent(), el);
+		}
+		el = el->next();
+	}
+	EXPECT_EQ(set.get_root()->get_parent(), nullptr);
+}
+
+T max_hi(const AVL::AVL_tree_t<AVL::interval_t<T>> *node) {
+	if (!node)
+		return std::numeric_limits<T>::min();
+	auto res = std::max({node->get_val().hi, max_hi(node->get_left()), max_hi(node->get_right())});
+	EXPECT_EQ(node->get_val().max_hi, res);
+	return res;
+}
+
+TEST(IntervalSet, Overlaps) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_interval_set_t<T> set;
+	std::vector<std::pair<T, T>> v;
+	for (auto i = 0; i < 10 * ksize; ++i) {
+		if (v.empty() || distr(e) % 3) {
+			auto lo = distr(e);
+			v.emplace_back(lo, lo + distr(e) / 10);
+			set.insert(v.back().first, v.back().second);
+		}
+		else {
+			auto pos = distr(e) % v.size();
+			set.erase(v[pos].first, v[pos].second);
+			v.erase(v.begin() + pos);
+		}
+		max_hi(set.get_set().get_root());
+
+		auto lo = distr(e);
+		auto hi = lo + distr(e) / 10;
+		std::vector<std::pair<T, T>> expected;
+		std::copy_if(v.begin(), v.end(), std::back_inserter(expected),
+			     [lo, hi](auto &in) { return in.first <= hi && in.second >= lo; });
+		std::sort(expected.begin(), expected.end());
+		std::vector<std::pair<T, T>> found;
+		set.overlaps(lo, hi, std::back_inserter(found));
+		EXPECT_EQ(found, expected);
+		EXPECT_EQ(set.count_overlaps(lo, hi), expected.size());
+		EXPECT_EQ(set.count_containing(lo),
+			  std::count_if(v.begin(), v.end(), [lo](auto &in) { return in.first <= lo && lo <= in.second; }));
+	}
+}
+
+TEST(IntervalSet, InfiniteEnds) {
+	constexpr auto inf = std::numeric_limits<double>::infinity();
+	AVL::AVL_interval_set_t<double> set;
+	set.insert(1, inf);
+	set.insert(1, 2);
+	set.insert(3, inf);
+	set.insert(-inf, 0.5);
+	EXPECT_EQ(set.count_overlaps(0, 1), 3);
+	EXPECT_EQ(set.count_overlaps(2.5, 2.5), 1);
+	EXPECT_EQ(set.count_overlaps(1, inf), 3);
+	EXPECT_EQ(set.count_containing(inf), 2);
+	EXPECT_EQ(set.count_containing(-inf), 1);
+}
+
+TEST(Server, Queries) {
+	std::vector<std::int32_t> v{{1, 3, 3, 5, 7, 9}};
+	AVL::AVL_set_t<std::int32_t> set{v.begin(), v.end()};
+	char path[] = "/tmp/avl_sockXXXXXX";
+	close(mkstemp(path));
+	AVL::AVL_query_server_t server{set, path, 2};
+	std::atomic<bool> stop{false};
+	std::thread serving{[&] { server.run(stop); }};
+	{
+		AVL::AVL_query_client_t client{path};
+		EXPECT_EQ(client.query({AVL::COUNT_LESS, 3, 0}), 1);
+		EXPECT_EQ(client.query({AVL::COUNT_GREATER, 3, 0}), 3);
+		EXPECT_EQ(client.query({AVL::GET_NTH, 4, 0}), 5);
+		EXPECT_EQ(client.query({AVL::GET_NTH, 7, 0}), AVL::bad_query);
+		EXPECT_EQ(client.query({AVL::RANGE_QUERY, 2, 7}), 4);
+		EXPECT_EQ(client.query({42, 0, 0}), AVL::bad_query);
+
+		std::vector<AVL::query_t> queries;
+		for (std::int32_t i = 0; i < 10000; ++i)
+			queries.push_back({AVL::RANGE_QUERY, i % 10, i % 10 + 3});
+		std::vector<std::uint64_t> answers(queries.size());
+		client.send(queries.data(), queries.size());
+		client.receive(answers.data(), answers.size());
+		for (std::size_t i = 0; i < queries.size(); ++i)
+			EXPECT_EQ(answers[i], set.range_query({queries[i].first, queries[i].second}));
+	}
+	stop = true;
+	serving.join();
+}
+
+TEST(Server, Backpressure) {
+	AVL::AVL_set_t<std::int32_t> set;
+	for (std::int32_t i = 0; i < 100; ++i)
+		set.insert(i);
+	char path[] = "/tmp/avl_sockXXXXXX";
+	close(mkstemp(path));
+	AVL::AVL_query_server_t server{set, path};
+	auto addr = AVL::detail::unix_address(path);
+	auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+	std::vector<AVL::query_t> queries(4096, AVL::query_t{AVL::COUNT_LESS, 50, 0});
+	auto data = reinterpret_cast<const char *>(queries.data());
+	auto bytes = queries.size() * sizeof(AVL::query_t);
+	std::size_t sent = 0, max_pending = 0;
+	// pipeline without reading: the server has to stop reading rather than buffer every reply;
+	// the requests are all the same, so a partial send continues from its offset in any of them
+	for (auto i = 0; i < 1000; ++i) {
+		auto offset = sent % sizeof(AVL::query_t);
+		auto res = send(fd, data + offset, bytes - offset, MSG_NOSIGNAL);
+		if (res > 0)
+			sent += res;
+		server.poll(0);
+		max_pending = std::max(max_pending, server.pending_output());
+	}
+	EXPECT_LT(max_pending, sent / sizeof(AVL::query_t) * sizeof(std::uint64_t) / 4);
+	// the rest of the requests is still answered once the client reads
+	std::size_t received = 0;
+	std::uint64_t answer = 0;
+	while (sent % sizeof(AVL::query_t) || received < sent / sizeof(AVL::query_t) * sizeof(std::uint64_t)) {
+		if (auto offset = sent % sizeof(AVL::query_t)) {
+			auto res = send(fd, data + offset, sizeof(AVL::query_t) - offset, MSG_NOSIGNAL);
+			if (res > 0)
+				sent += res;
+		}
+		auto res = read(fd, &answer, sizeof(answer));
+		if (res > 0) {
+			ASSERT_EQ(res, sizeof(answer));
+			EXPECT_EQ(answer, 50);
+			received += res;
+		}
+		else
+			server.poll(0);
+	}
+	close(fd);
+}
+
+TEST(Server, HalfClose) {
+	AVL::AVL_set_t<std::int32_t> set;
+	for (std::int32_t i = 0; i < 100; ++i)
+		set.insert(i);
+	char path[] = "/tmp/avl_sockXXXXXX";
+	close(mkstemp(path));
+	AVL::AVL_query_server_t server{set, path};
+	auto addr = AVL::detail::unix_address(path);
+	auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+	AVL::query_t query{AVL::COUNT_LESS, 50, 0};
+	ASSERT_EQ(send(fd, &query, sizeof(query), MSG_NOSIGNAL), sizeof(query));
+	ASSERT_EQ(shutdown(fd, SHUT_WR), 0);
+	// the request and the end of the stream may arrive in the same read
+	std::uint64_t answer = 0;
+	std::size_t received = 0;
+	bool closed = false;
+	for (auto i = 0; i < 100 && !closed; ++i) {
+		server.poll(10);
+		auto res = read(fd, reinterpret_cast<char *>(&answer) + received, sizeof(answer) - received);
+		if (res > 0)
+			received += res;
+		closed = !res;
+	}
+	EXPECT_EQ(received, sizeof(answer));
+	EXPECT_EQ(answer, 50);
+	EXPECT_TRUE(closed);
+	close(fd);
+}
+
+std::size_t depth(const AVL::AVL_tree_t<T> *node) {
+	if (!node)
+		return 0;
+	return std::max(depth(node->get_left()), depth(node->get_right())) + 1;
+}
+
+TEST(Relaxed, SortedBurst) {
+	AVL::AVL_set_t<T> set;
+	for (auto i = 0; i < ksize; ++i)
+		set.insert(2 * i);
+	set.set_relaxed(true);
+	for (auto i = 0; i < 10 * ksize; ++i) {
+		set.insert(2 * ksize + i);
+		EXPECT_LE(depth(set.get_root()), AVL::AVL_tree_t<T>::max_relaxed_depth(set.size()));
+	}
+	for (auto i = 0; i < ksize; i += 2)
+		set.erase(2 * i);
+	EXPECT_EQ(set.size(), 11 * ksize - ksize / 2);
+	EXPECT_EQ(set.count_less(2 * ksize), ksize / 2);
+	EXPECT_EQ(set.get_root()->get_nth(ksize / 2 + 1)->get_val(), 2 * ksize);
+	set.set_relaxed(false);
+	EXPECT_FALSE(set.is_relaxed());
+	height(set.get_root());
+	EXPECT_EQ(set.range_query({0, 2 * ksize}), ksize / 2 + 1);
+}
+
+TEST(Relaxed, RandomBurst) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_set_t<T> set;
+	std::vector<T> v;
+	set.set_relaxed(true);
+	for (auto i = 0; i < 10 * ksize; ++i) {
+		if (v.empty() || distr(e) % 3) {
+			v.push_back(distr(e));
+			set.insert(v.back());
+		}
+		else {
+			auto pos = distr(e) % v.size();
+			set.erase(v[pos]);
+			v.erase(v.begin() + pos);
+		}
+		auto key = distr(e);
+		EXPECT_EQ(set.count_less(key), std::count_if(v.begin(), v.end(), [key](T i) { return i < key; }));
+	}
+	set.set_relaxed(false);
+	height(set.get_root());
+	std::sort(v.begin(), v.end());
+	auto el = set.min();
+	for (auto i : v) {
+		EXPECT_EQ(el->get_val(), i);
+		EXPECT_EQ(el->get_size(), el->get_lsize() + el->get_rsize() + 1);
+		el = el->next();
+	}
+}
+
+TEST(Storage, Arena) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_arena_t arena{AVL::page_mode_t::hugetlb, AVL::numa_policy_t::interleave};
+	AVL::AVL_set_t<T> set{&arena};
+	std::vector<T> v;
+	for (auto i = 0; i < 10 * ksize; ++i) {
+		v.push_back(distr(e));
+		set.insert(v.back());
+	}
+	for (auto i = 0; i < ksize; ++i) {
+		set.erase(v.back());
+		v.pop_back();
+	}
+	EXPECT_EQ(arena.live(), v.size());
+	EXPECT_GT(arena.mapped_bytes(), 0);
+	std::sort(v.begin(), v.end());
+	auto el = set.min();
+	for (auto i : v) {
+		EXPECT_EQ(el->get_val(), i);
+		el = el->next();
+	}
+	AVL::AVL_set_t<T> copy{set};
+	EXPECT_EQ(copy.get_storage(), &arena);
+	EXPECT_EQ(arena.live(), 2 * v.size());
+	// the arena is shared with the copy, so the set is freed node by node
+	set.clear();
+	EXPECT_EQ(arena.live(), v.size());
+	copy.clear();
+	EXPECT_EQ(arena.mapped_bytes(), 0);
+	copy.insert(1);
+	EXPECT_EQ(arena.live(), 1);
+}
+
+TEST(Storage, Replicas) {
+	std::vector<T> v(ksize);
+	std::iota(v.begin(), v.end(), 0);
+	AVL::AVL_set_t<T> set{v.begin(), v.end()};
+	std::vector<std::unique_ptr<AVL::AVL_arena_t>> arenas;
+	std::vector<AVL::AVL_set_t<T>> replicas;
+	for (auto node = 0; node < AVL::numa_nodes(); ++node) {
+		arenas.push_back(std::make_unique<AVL::AVL_arena_t>(AVL::page_mode_t::transparent, AVL::numa_policy_t::preferred, node));
+		replicas.emplace_back(set, arenas.back().get());
+	}
+	for (std::size_t i = 0; i < replicas.size(); ++i) {
+		EXPECT_EQ(arenas[i]->live(), ksize);
+		EXPECT_EQ(replicas[i].range_query({10, 19}), 10);
+		height(replicas[i].get_root());
+	}
+	replicas.clear();
+}
+
+// counts live copies to check that dropped versions free their nodes
+struct counted_t {
+	static inline int live = 0;
+	T val;
+	counted_t(T val_) : val(val_) {
+		live++;
+	}
+	counted_t(const counted_t &other) : val(other.val) {
+		live++;
+	}
+	~counted_t() {
+		live--;
+	}
+	bool operator < (const counted_t &rhs) const {
+		return val < rhs.val;
+	}
+};
+
+TEST(Persistent, Versions) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_versioned_set_t<T> set;
+	std::vector<std::vector<T>> models{{}};
+	for (auto i = 0; i < 5 * ksize; ++i) {
+		auto v = models.back();
+		auto key = distr(e);
+		if (v.empty() || distr(e) % 3) {
+			v.insert(std::upper_bound(v.begin(), v.end(), key), key);
+			EXPECT_EQ(set.insert(key), models.size());
+		}
+		else {
+			auto it = std::lower_bound(v.begin(), v.end(), key);
+			if (it != v.end() && *it == key)
+				v.erase(it);
+			EXPECT_EQ(set.erase(key), models.size());
+		}
+		models.push_back(v);
+	}
+	for (std::size_t version = 0; version < models.size(); ++version) {
+		auto &v = models[version];
+		auto &snapshot = set.at(version);
+		ASSERT_EQ(snapshot.size(), v.size());
+		EXPECT_LE(snapshot.get_height(), 1.45 * std::log2(v.size() + 2));
+		for (std::size_t n = 1; n <= v.size(); ++n)
+			EXPECT_EQ(snapshot.get_nth(n), v[n - 1]);
+		auto key = distr(e);
+		EXPECT_EQ(snapshot.order(key), std::lower_bound(v.begin(), v.end(), key) - v.begin());
+		EXPECT_EQ(snapshot.range_query({key, key + 10}),
+			  std::upper_bound(v.begin(), v.end(), key + 10) - std::lower_bound(v.begin(), v.end(), key));
+		EXPECT_EQ(snapshot.contains(key), std::binary_search(v.begin(), v.end(), key));
+	}
+}
+
+TEST(Persistent, DropVersions) {
+	{
+		AVL::AVL_versioned_set_t<counted_t> set;
+		for (auto i = 0; i < 10 * ksize; ++i)
+			set.insert(i);
+		// every update copies only the path
+		auto before = counted_t::live;
+		set.insert(ksize / 2);
+		EXPECT_LE(counted_t::live - before, 2 * set.current().get_height());
+		auto old = set.at(ksize);
+		set.drop_before(set.version());
+		EXPECT_EQ(set.oldest(), set.version());
+		EXPECT_EQ(old.size(), ksize);
+		EXPECT_EQ(old.get_nth(ksize).val, ksize - 1);
+		old = AVL::AVL_snapshot_t<counted_t>{};
+		EXPECT_EQ(counted_t::live, 10 * ksize + 1);
+		set.erase(0);
+		set.drop_before(set.version());
+		EXPECT_EQ(counted_t::live, 10 * ksize);
+	}
+	EXPECT_EQ(counted_t::live, 0);
+}
+
+TEST(Packed, MatchesSet) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{-ksize, ksize};
+	AVL::AVL_packed_set_t<T> packed;
+	std::vector<T> v;
+	for (auto i = 0; i < 100 * ksize; ++i) {
+		auto key = distr(e);
+		if (distr(e) > -ksize / 2) {
+			v.insert(std::upper_bound(v.begin(), v.end(), key), key);
+			packed.insert(key);
+		}
+		else {
+			auto it = std::lower_bound(v.begin(), v.end(), key);
+			if (it != v.end() && *it == key)
+				v.erase(it);
+			packed.erase(key);
+		}
+		ASSERT_EQ(packed.size(), v.size());
+		EXPECT_EQ(packed.count_less(key), std::lower_bound(v.begin(), v.end(), key) - v.begin());
+		EXPECT_EQ(packed.count_greater(key), v.end() - std::upper_bound(v.begin(), v.end(), key));
+		EXPECT_EQ(packed.contains(key), std::binary_search(v.begin(), v.end(), key));
+	}
+	for (std::size_t n = 1; n <= v.size(); ++n)
+		EXPECT_EQ(packed.get_nth(n), v[n - 1]);
+	EXPECT_EQ(packed.min(), v.front());
+	EXPECT_EQ(packed.max(), v.back());
+	while (!v.empty()) {
+		packed.erase(v.back());
+		v.pop_back();
+	}
+	EXPECT_TRUE(packed.empty());
+}
+
+TEST(Packed, WideKeys) {
+	using K = long long;
+	std::vector<K> v{{std::numeric_limits<K>::min(), -1, 0, 1, 1LL << 40, std::numeric_limits<K>::max()}};
+	AVL::AVL_packed_set_t<K> packed;
+	packed.assign_sorted(v.begin(), v.size());
+	for (std::size_t n = 1; n <= v.size(); ++n)
+		EXPECT_EQ(packed.get_nth(n), v[n - 1]);
+	EXPECT_EQ(packed.range_query({-1, 1LL << 40}), 4);
+	packed.insert(2);
+	EXPECT_EQ(packed.order(1LL << 40), 5);
+}
+
+TEST(Packed, DenseKeys) {
+	// evenly spaced keys, as range_tests/gen_test.cpp writes them
+	AVL::AVL_packed_set_t<T> packed;
+	std::size_t n = 1000 * ksize;
+	for (std::size_t i = 0; i < n; ++i)
+		packed.insert(10 * i);
+	EXPECT_LT(packed.bytes(), 2 * n);
+	EXPECT_EQ(packed.range_query({15, 10 * ksize}), ksize - 1);
+	EXPECT_EQ(packed.get_nth(n), 10 * (n - 1));
+	for (std::size_t i = 0; i < n; i += 3)
+		packed.erase(10 * i);
+	EXPECT_LT(packed.bytes(), 2 * n);
+	EXPECT_EQ(packed.size(), n - (n + 2) / 3);
+	EXPECT_EQ(packed.count_less(10 * ksize), ksize - (ksize + 2) / 3);
+}
+
+TEST(Export, CopyRange) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	std::vector<T> v;
+	for (auto i = 0; i < 10 * ksize; ++i)
+		v.push_back(distr(e));
+	AVL::AVL_set_t<T> set{v.begin(), v.end()};
+	std::sort(v.begin(), v.end());
+	for (auto i = 0; i < ksize; ++i) {
+		auto lo = distr(e), hi = distr(e);
+		if (hi < lo)
+			std::swap(lo, hi);
+		std::vector<T> keys;
+		set.copy_range(lo, hi, std::back_inserter(keys));
+		EXPECT_TRUE(std::equal(keys.begin(), keys.end(), std::lower_bound(v.begin(), v.end(), lo),
+				       std::upper_bound(v.begin(), v.end(), hi)));
+	}
+	std::vector<T> keys;
+	AVL::AVL_set_t<T>{}.copy_range(0, ksize, std::back_inserter(keys));
+	set.copy_range(ksize + 1, 2 * ksize, std::back_inserter(keys));
+	EXPECT_TRUE(keys.empty());
+}
+
+TEST(Export, Chunks) {
+	std::vector<T> v(10 * ksize);
+	for (std::size_t i = 0; i < v.size(); ++i)
+		v[i] = i / 3;
+	AVL::AVL_set_t<T> set{v.begin(), v.end()};
+	std::vector<T> keys;
+	std::size_t chunks = 0;
+	set.for_each_range(ksize, 2 * ksize, [&](const T *data, std::size_t n) {
+		EXPECT_LE(n, 64);
+		keys.insert(keys.end(), data, data + n);
+		chunks++;
+	}, 64);
+	EXPECT_EQ(keys.size(), 3 * (ksize + 1));
+	EXPECT_EQ(chunks, (keys.size() + 63) / 64);
+	EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+	EXPECT_EQ(keys.front(), ksize);
+	EXPECT_EQ(keys.back(), 2 * ksize);
+
+	// pages of a cursor continue where the previous one stopped
+	auto cursor = set.cursor(0, ksize);
+	std::vector<T> page(7), all;
+	while (!cursor.done()) {
+		auto end = cursor.read(page.data(), page.size());
+		all.insert(all.end(), page.data(), end);
+	}
+	EXPECT_TRUE(std::equal(all.begin(), all.end(), v.begin(), v.begin() + 3 * (ksize + 1)));
+}
+
+// checks that the nodes lie one after another in BFS order, as compact() places them
+bool bfs_contiguous(const AVL::AVL_tree_t<T> *root) {
+	std::vector<const AVL::AVL_tree_t<T> *> nodes{root};
+	for (std::size_t i = 0; i < nodes.size(); ++i) {
+		if (nodes[i] != root + i)
+			return false;
+		if (nodes[i]->get_left())
+			nodes.push_back(nodes[i]->get_left());
+		if (nodes[i]->get_right())
+			nodes.push_back(nodes[i]->get_right());
+	}
+	return true;
+}
+
+TEST(Compact, Heap) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, ksize};
+	AVL::AVL_set_t<T> set;
+	std::vector<T> v;
+	for (auto i = 0; i < 10 * ksize; ++i) {
+		v.push_back(distr(e));
+		set.insert(v.back());
+		if (i % 3 == 0)
+			set.erase(v[i / 2]);
+	}
+	std::vector<T> before;
+	set.copy_range(0, ksize, std::back_inserter(before));
+	set.compact();
+	EXPECT_NE(set.get_storage(), nullptr);
+	EXPECT_TRUE(bfs_contiguous(set.get_root()));
+	height(set.get_root());
+	std::vector<T> after;
+	set.copy_range(0, ksize, std::back_inserter(after));
+	EXPECT_EQ(before, after);
+	// the copy does not share the arena owned by the set
+	AVL::AVL_set_t<T> copy{set};
+	EXPECT_EQ(copy.get_storage(), nullptr);
+	set.insert(ksize / 2);
+	set.erase(before.front());
+	height(set.get_root());
+	EXPECT_EQ(set.size(), before.size());
+}
+
+TEST(Compact, SmallHeap) {
+	// the compaction state is allocated only while it is needed
+	EXPECT_LE(sizeof(AVL::AVL_set_t<T>), 4 * sizeof(void *));
+	AVL::AVL_set_t<T> set;
+	for (auto i = 0; i < ksize; ++i)
+		set.insert(i);
+	set.compact();
+	auto arena = static_cast<const AVL::AVL_arena_t *>(set.get_storage());
+	ASSERT_NE(arena, nullptr);
+	// a set far below a huge page gets an arena of normal pages that fits it
+	EXPECT_LT(arena->mapped_bytes(), AVL::detail::huge_page);
+	EXPECT_GE(arena->mapped_bytes(), set.size() * sizeof(AVL::AVL_tree_t<T>));
+	EXPECT_TRUE(bfs_contiguous(set.get_root()));
+	for (auto i = 0; i < ksize; ++i)
+		set.insert(ksize + i);
+	EXPECT_EQ(arena->live(), set.size());
+	EXPECT_EQ(set.count_less(ksize), ksize);
+}
+
+TEST(Compact, Trim) {
+	AVL::AVL_arena_t arena;
+	AVL::AVL_set_t<T> set{&arena};
+	for (auto i = 0; i < 2000 * ksize; ++i)
+		set.insert(i);
+	for (auto i = 0; i < 2000 * ksize; ++i)
+		if (i % 10)
+			set.erase(i);
+	auto mapped = arena.mapped_bytes();
+	set.compact();
+	EXPECT_TRUE(bfs_contiguous(set.get_root()));
+	EXPECT_EQ(arena.live(), set.size());
+	EXPECT_LT(arena.mapped_bytes(), mapped);
+}
+
+TEST(Compact, Incremental) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, 100 * ksize};
+	AVL::AVL_arena_t arena;
+	AVL::AVL_set_t<T> set{&arena};
+	for (auto i = 0; i < 1000 * ksize; ++i)
+		set.insert(distr(e));
+	for (auto i = 0; i < 900 * ksize; ++i)
+		set.erase(set.get_root()->get_nth(distr(e) % set.size() + 1)->get_val());
+	auto mapped = arena.mapped_bytes();
+	auto steps = 0;
+	while (!set.compact_step(ksize)) {
+		steps++;
+		EXPECT_EQ(set.range_query({0, 100 * ksize}), set.size());
+	}
+	EXPECT_EQ(steps, (set.size() - 1) / (ksize + 1));
+	EXPECT_TRUE(bfs_contiguous(set.get_root()));
+	height(set.get_root());
+	EXPECT_EQ(arena.live(), set.size());
+	EXPECT_LT(arena.mapped_bytes(), mapped);
+}
+
+TEST(Compact, Churn) {
+	std::default_random_engine e;
+	std::uniform_int_distribution<T> distr{0, 100 * ksize};
+	AVL::AVL_arena_t arena;
+	AVL::AVL_set_t<T> set{&arena};
+	for (auto i = 0; i < 1000 * ksize; ++i)
+		set.insert(distr(e));
+	for (auto i = 0; i < 800 * ksize; ++i)
+		set.erase(set.get_root()->get_nth(distr(e) % set.size() + 1)->get_val());
+	auto mapped = arena.mapped_bytes();
+	// an update between every two slices keeps the nodes already moved
+	auto steps = 0;
+	while (!set.compact_step(10 * ksize)) {
+		set.insert(distr(e));
+		set.erase(set.get_root()->get_nth(distr(e) % set.size() + 1)->get_val());
+		ASSERT_LT(++steps, 30);
+	}
+	height(set.get_root());
+	EXPECT_EQ(arena.live(), set.size());
+	EXPECT_LT(arena.mapped_bytes(), mapped);
+	// on the global heap the set moves into an arena of its own in slices as well, and nodes
+	// erased meanwhile are freed where they are
+	std::vector<T> v;
+	set.copy_range(0, 100 * ksize, std::back_inserter(v));
+	AVL::AVL_set_t<T> heap{v.begin(), v.end()};
+	steps = 0;
+	while (!heap.compact_step(10 * ksize)) {
+		EXPECT_NE(heap.get_storage(), nullptr);
+		heap.insert(distr(e));
+		heap.erase(heap.get_root()->get_nth(distr(e) % heap.size() + 1)->get_val());
+		heap.erase(heap.get_root()->get_nth(distr(e) % heap.size() + 1)->get_val());
+		ASSERT_LT(++steps, 30);
+	}
+	EXPECT_GT(steps, 1);
+	height(heap.get_root());
+	EXPECT_EQ(static_cast<AVL::AVL_arena_t *>(heap.get_storage())->live(), heap.size());
+	// a set moved or cleared halfway keeps freeing its heap nodes to the heap
+	AVL::AVL_set_t<T> half{v.begin(), v.end()};
+	EXPECT_FALSE(half.compact_step(ksize));
+	auto moved = std::move(half);
+	moved.erase(v.front());
+	EXPECT_FALSE(moved.compact_step(ksize));
+	moved.clear();
+	EXPECT_EQ(moved.get_storage(), nullptr);
+	moved.insert(1);
+	EXPECT_TRUE(moved.compact_step(1));
+}
 }
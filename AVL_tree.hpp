@@ -1,8 +1,50 @@
 #pragma once
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <initializer_list>
+#include <new>
+#include <vector>
 
 namespace AVL
 {
+// Specialize with enabled = true to keep a subtree summary inside T: update(val, left, right)
+// recomputes it from the node's own value and its children's values (nullptr if missing)
+template <typename T>
+struct augment_traits {
+	static constexpr bool enabled = false;
+	static void update(T &, const T *, const T *) {}
+};
+
+// Memory nodes are placed in; functions taking a storage use the global heap when given nullptr.
+// Every allocation has the size of one node, a storage is not required to be thread safe.
+class AVL_storage_t {
+	public:
+	virtual ~AVL_storage_t() = default;
+	virtual void *allocate(std::size_t size) = 0;
+	virtual void deallocate(void *ptr, std::size_t size) = 0;
+	// drops every allocation at once if live_nodes, the nodes of the caller's tree, are all
+	// the storage holds; returns false when it cannot, and the tree must be freed node by node
+	virtual bool release(std::size_t live_nodes) {
+		(void)live_nodes;
+		return false;
+	}
+	// allocations of size from now on should lie next to each other, e.g. the nodes of a tree
+	// being compacted, until reserve(size, 0); n of them are expected
+	virtual void reserve(std::size_t size, std::size_t n) {
+		(void)size;
+		(void)n;
+	}
+	// whether ptr was allocated since reserve started, so lies with the other such allocations;
+	// a storage that cannot tell returns false, and compaction starts over after every update
+	virtual bool reserved(const void *ptr) const {
+		(void)ptr;
+		return false;
+	}
+	// returns memory that no longer holds nodes to the system where possible
+	virtual void trim() {}
+};
+
 template <typename T>
 class AVL_tree_t final {
 	T val_;
@@ -25,11 +67,26 @@ class AVL_tree_t final {
 	void update_size() {
 		size_ = get_lsize() + get_rsize() + 1;
 	}
+	void update_augment() {
+		if constexpr (augment_traits<T>::enabled)
+			augment_traits<T>::update(val_, left_ ? &left_->val_ : nullptr, right_ ? &right_->val_ : nullptr);
+	}
+	void update_augment_path() {
+		if constexpr (augment_traits<T>::enabled)
+			for (auto node = this; node; node = node->parent_)
+				node->update_augment();
+	}
 
 	AVL_tree_t(const T &elem, AVL_tree_t *parent = nullptr) :
 		val_(elem), parent_(parent)
 	{}
 	~AVL_tree_t() = default;
+	static AVL_tree_t *make_node(const T &elem, AVL_tree_t *parent, AVL_tree_t *spare, AVL_storage_t *storage);
+	template <typename InputIt>
+	static AVL_tree_t *build_sorted(InputIt &first, std::size_t n, AVL_tree_t *parent, int &height, AVL_storage_t *storage);
+	static AVL_tree_t *link_balanced(AVL_tree_t **nodes, std::size_t n, AVL_tree_t *parent, int &height);
+	void swap_down(AVL_tree_t *node, AVL_tree_t *&root);
+	AVL_tree_t *detach_relaxed(AVL_tree_t *&root);
 
 	public:
 	AVL_tree_t(const AVL_tree_t &other) = delete;
@@ -46,8 +103,50 @@ class AVL_tree_t final {
 
 	const AVL_tree_t *get_nth(std::size_t n) const;
 	std::size_t order(const T &val) const;
+	std::size_t count_less(const T &val) const;
+	std::size_t count_greater(const T &val) const;
+	const AVL_tree_t *nth_in_range(const T &lo, const T &hi, std::size_t k) const;
 
-	AVL_tree_t *insert(const T &elem, AVL_tree_t *root);
+	static AVL_tree_t *create(const T &elem, AVL_tree_t *parent = nullptr, AVL_storage_t *storage = nullptr) {
+		if (!storage)
+			return new AVL_tree_t(elem, parent);
+		auto mem = storage->allocate(sizeof(AVL_tree_t));
+		try {
+			return new (mem) AVL_tree_t(elem, parent);
+		}
+		catch (...) {
+			storage->deallocate(mem, sizeof(AVL_tree_t));
+			throw;
+		}
+	}
+	// frees a single node, which must not be linked into a tree any more
+	static void destroy(AVL_tree_t *node, AVL_storage_t *storage = nullptr) {
+		if (!storage) {
+			delete node;
+			return;
+		}
+		node->~AVL_tree_t();
+		storage->deallocate(node, sizeof(AVL_tree_t));
+	}
+
+	static AVL_tree_t *insert(const T &elem, AVL_tree_t *root, AVL_tree_t *spare = nullptr, AVL_storage_t *storage = nullptr);
+	static AVL_tree_t *insert_relaxed(const T &elem, AVL_tree_t *root, AVL_tree_t *spare = nullptr, AVL_storage_t *storage = nullptr);
+	AVL_tree_t *rebuild(AVL_tree_t *root) {
+		std::vector<AVL_tree_t *> nodes;
+		return rebuild(root, nodes);
+	}
+	AVL_tree_t *rebuild(AVL_tree_t *root, std::vector<AVL_tree_t *> &nodes);
+	AVL_tree_t *repair(AVL_tree_t *root);
+	static int repair_heights(AVL_tree_t *node, std::vector<AVL_tree_t *> &unbalanced);
+	// h_dif_ of nodes on the paths touched by relaxed updates
+	static constexpr signed char relaxed_dirty = 3;
+	static std::size_t max_relaxed_depth(std::size_t size) {
+		return static_cast<std::size_t>(std::log(static_cast<double>(size)) / std::log(4.0 / 3)) + 2;
+	}
+	template <typename InputIt>
+	static AVL_tree_t *build_sorted(InputIt &first, std::size_t n, AVL_tree_t *parent = nullptr, AVL_storage_t *storage = nullptr);
+	static AVL_tree_t *join(AVL_tree_t *left, const T &elem, AVL_tree_t *right, AVL_storage_t *storage = nullptr);
+	static void delete_tree(AVL_tree_t *root, AVL_storage_t *storage = nullptr);
 
 	T get_val() const {
 		return val_;
@@ -58,6 +157,12 @@ class AVL_tree_t final {
 	std::size_t get_size() const {
 		return size_;
 	}
+	int get_height() const {
+		int height = 0;
+		for (auto node = this; node; node = (node->h_dif_ < 0) ? node->right_ : node->left_)
+			height++;
+		return height;
+	}
 	std::size_t get_lsize() const {
 		return left_ ? left_->size_ : 0;
 	}
@@ -108,27 +213,47 @@ class AVL_tree_t final {
 		return const_cast<AVL_tree_t *>(const_cast<const AVL_tree_t *>(this)->prev());
 	}
 
-	AVL_tree_t *delete_node(AVL_tree_t *root);
-	AVL_tree_t *delete_leaf(AVL_tree_t *root);
+	AVL_tree_t *delete_node(AVL_tree_t *root, bool rebalance = true, AVL_storage_t *storage = nullptr);
+	AVL_tree_t *detach_node(AVL_tree_t *&root, bool rebalance = true);
+	AVL_tree_t *delete_leaf(AVL_tree_t *root, AVL_storage_t *storage = nullptr);
+	AVL_tree_t *relocate(AVL_tree_t *&root, AVL_storage_t *from, AVL_storage_t *to);
+	AVL_tree_t *unlink_leaf(AVL_tree_t *root);
 };
 
+// spare, if given, is a node returned by detach_node and is reused instead of allocating a new one
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::make_node(const T &elem, AVL_tree_t *parent, AVL_tree_t *spare, AVL_storage_t *storage) {
+	auto node = spare;
+	if (!node)
+		node = create(elem, parent, storage);
+	else {
+		node->val_ = elem;
+		node->parent_ = parent;
+		node->left_ = node->right_ = nullptr;
+		node->h_dif_ = 0;
+		node->size_ = 1;
+	}
+	node->update_augment();
+	return node;
+}
+
 template <typename T>
-AVL_tree_t<T> *AVL_tree_t<T>::insert(const T &elem, AVL_tree_t *root) {
+AVL_tree_t<T> *AVL_tree_t<T>::insert(const T &elem, AVL_tree_t *root, AVL_tree_t *spare, AVL_storage_t *storage) {
 	if (!root)
-		return new AVL_tree_t(elem);
+		return make_node(elem, nullptr, spare, storage);
 	auto node = root;
 	while (true) {
 		node->size_++;
 		if (elem < node->val_) {
 			if (!node->left_) {
-				node->left_ = new AVL_tree_t(elem, node);
+				node->left_ = make_node(elem, node, spare, storage);
 				node->h_dif_++;
 				break;
 			}
 			node = node->left_;
 		}
 		else if (!node->right_) {
-			node->right_ = new AVL_tree_t(elem, node);
+			node->right_ = make_node(elem, node, spare, storage);
 			node->h_dif_--;
 			break;
 		}
@@ -136,20 +261,198 @@ AVL_tree_t<T> *AVL_tree_t<T>::insert(const T &elem, AVL_tree_t *root) {
 			node = node->right_;	
 	}
 
-	while (node->parent_) {
+	node->update_augment_path();
+	while (node->h_dif_ && node->parent_) {
 		auto prev = node;
 		node = node->parent_;
 		if (node->left_ == prev)
 			node->h_dif_++;
 		else
 			node->h_dif_--;
-		root = node->balance(root);
-		if (!node->h_dif_)
-			return root;
+		if (node->h_dif_ == 2 || node->h_dif_ == -2)
+			return node->balance(root);
+	}
+	return root;
+}
+
+// Plain BST insertion that keeps size_ and marks the path as relaxed_dirty for repair
+// instead of rotating. A path longer than max_relaxed_depth passes through a node with a child
+// holding over 3/4 of its subtree (scapegoat), and that subtree is rebuilt, so paths stay
+// O(log n) even for sorted input.
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::insert_relaxed(const T &elem, AVL_tree_t *root, AVL_tree_t *spare, AVL_storage_t *storage) {
+	if (!root)
+		return make_node(elem, nullptr, spare, storage);
+	auto node = root;
+	AVL_tree_t *leaf;
+	std::size_t depth = 1;
+	while (true) {
+		node->size_++;
+		node->h_dif_ = relaxed_dirty;
+		depth++;
+		if (elem < node->val_) {
+			if (!node->left_) {
+				leaf = node->left_ = make_node(elem, node, spare, storage);
+				break;
+			}
+			node = node->left_;
+		}
+		else if (!node->right_) {
+			leaf = node->right_ = make_node(elem, node, spare, storage);
+			break;
+		}
+		else
+			node = node->right_;
 	}
+	node->update_augment_path();
+
+	if (depth <= max_relaxed_depth(root->size_))
+		return root;
+	for (auto child = leaf; child->parent_; child = child->parent_)
+		if (4 * child->size_ > 3 * child->parent_->size_)
+			return child->parent_->rebuild(root);
+	return root->rebuild(root);
+}
+
+// Restores h_dif_ on relaxed_dirty nodes and rebuilds the highest subtrees whose children
+// differ in height by more than one. Only dirty paths are visited, so the cost follows the
+// number of relaxed updates rather than the tree size.
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::repair(AVL_tree_t *root) {
+	std::vector<AVL_tree_t *> unbalanced, nodes;
+	repair_heights(this, unbalanced);
+	for (auto node : unbalanced)
+		root = node->rebuild(root, nodes);
+	return root;
+}
+
+// returns the height the subtree will have once the nodes collected in unbalanced are rebuilt
+template <typename T>
+int AVL_tree_t<T>::repair_heights(AVL_tree_t *node, std::vector<AVL_tree_t *> &unbalanced) {
+	if (!node)
+		return 0;
+	if (node->h_dif_ != relaxed_dirty)
+		return node->get_height();
+	auto n_unbalanced = unbalanced.size();
+	auto lheight = repair_heights(node->left_, unbalanced);
+	auto rheight = repair_heights(node->right_, unbalanced);
+	if (lheight - rheight > 1 || rheight - lheight > 1) {
+		// rebuilding this subtree covers the ones found below
+		unbalanced.resize(n_unbalanced);
+		unbalanced.push_back(node);
+		int height = 0;
+		for (auto size = node->size_; size; size /= 2)
+			height++;
+		return height;
+	}
+	node->h_dif_ = lheight - rheight;
+	return std::max(lheight, rheight) + 1;
+}
+
+// relinks the subtree of this node into a perfectly balanced one in O(n), nodes is scratch space
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::rebuild(AVL_tree_t *root, std::vector<AVL_tree_t *> &nodes) {
+	auto parent = parent_;
+	AVL_tree_t *&ptr_to_this = (parent) 	? ((parent->left_ == this)	? parent->left_
+										: parent->right_)
+						: root;
+	nodes.clear();
+	nodes.reserve(size_);
+	for (auto node = min(); nodes.size() < size_; node = node->next())
+		nodes.push_back(node);
+	int height;
+	ptr_to_this = link_balanced(nodes.data(), nodes.size(), parent, height);
 	return root;
 }
 
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::link_balanced(AVL_tree_t **nodes, std::size_t n, AVL_tree_t *parent, int &height) {
+	if (!n) {
+		height = 0;
+		return nullptr;
+	}
+	auto lsize = (n - 1) / 2;
+	auto node = nodes[lsize];
+	int lheight, rheight;
+	node->parent_ = parent;
+	node->left_ = link_balanced(nodes, lsize, node, lheight);
+	node->right_ = link_balanced(nodes + lsize + 1, n - lsize - 1, node, rheight);
+	node->size_ = n;
+	node->h_dif_ = lheight - rheight;
+	node->update_augment();
+	height = std::max(lheight, rheight) + 1;
+	return node;
+}
+
+// links n sorted elements taken from first into a balanced tree in O(n)
+template <typename T>
+template <typename InputIt>
+AVL_tree_t<T> *AVL_tree_t<T>::build_sorted(InputIt &first, std::size_t n, AVL_tree_t *parent, AVL_storage_t *storage) {
+	int height;
+	return build_sorted(first, n, parent, height, storage);
+}
+
+template <typename T>
+template <typename InputIt>
+AVL_tree_t<T> *AVL_tree_t<T>::build_sorted(InputIt &first, std::size_t n, AVL_tree_t *parent, int &height, AVL_storage_t *storage) {
+	if (!n) {
+		height = 0;
+		return nullptr;
+	}
+	auto lsize = (n - 1) / 2;
+	int lheight, rheight;
+	auto left = build_sorted(first, lsize, nullptr, lheight, storage);
+	auto node = create(*first, parent, storage);
+	++first;
+	node->left_ = left;
+	if (left)
+		left->parent_ = node;
+	node->right_ = build_sorted(first, n - lsize - 1, node, rheight, storage);
+	node->size_ = n;
+	node->h_dif_ = lheight - rheight;
+	node->update_augment();
+	height = std::max(lheight, rheight) + 1;
+	return node;
+}
+
+// roots left and right, whose heights differ at most by one and which lie on both sides of elem, at a new node
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::join(AVL_tree_t *left, const T &elem, AVL_tree_t *right, AVL_storage_t *storage) {
+	auto node = create(elem, nullptr, storage);
+	node->left_ = left;
+	node->right_ = right;
+	if (left)
+		left->parent_ = node;
+	if (right)
+		right->parent_ = node;
+	node->update_size();
+	node->update_augment();
+	auto h_dif = (left ? left->get_height() : 0) - (right ? right->get_height() : 0);
+	assert(h_dif >= -1 && h_dif <= 1);
+	node->h_dif_ = h_dif;
+	return node;
+}
+
+// frees the whole tree in O(n) without extra memory: left children are rotated up until
+// the current node has none, then it is freed and its right subtree is processed
+template <typename T>
+void AVL_tree_t<T>::delete_tree(AVL_tree_t *root, AVL_storage_t *storage) {
+	auto node = root;
+	while (node) {
+		auto left = node->left_;
+		if (left) {
+			node->left_ = left->right_;
+			left->right_ = node;
+			node = left;
+		}
+		else {
+			auto right = node->right_;
+			destroy(node, storage);
+			node = right;
+		}
+	}
+}
+
 template <typename T>
 const AVL_tree_t<T> *AVL_tree_t<T>::search(const T &elem) const {
 	auto node = this;
@@ -234,22 +537,72 @@ std::size_t AVL_tree_t<T>::order(const T &val) const {
 }
 
 template <typename T>
-AVL_tree_t<T> *AVL_tree_t<T>::delete_node(AVL_tree_t *root) {
+std::size_t AVL_tree_t<T>::count_less(const T &val) const {
+	auto node = this;
+	std::size_t res = 0;
+	while (node) {
+		if (node->val_ < val) {
+			res += node->get_lsize() + 1;
+			node = node->right_;
+		}
+		else
+			node = node->left_;
+	}
+	return res;
+}
+
+template <typename T>
+std::size_t AVL_tree_t<T>::count_greater(const T &val) const {
 	auto node = this;
-	while (node->right_ || node->left_) {
-		auto next = node->right_ ? node->right_->min() : node->left_->max();
-		node->val_ = next->val_;
-		node = next;
+	std::size_t res = 0;
+	while (node) {
+		if (val < node->val_) {
+			res += node->get_rsize() + 1;
+			node = node->left_;
+		}
+		else
+			node = node->right_;
 	}
+	return res;
+}
+
+// k-th (starting from 1) of the elements lying in [lo, hi], nullptr if there are less than k of them
+template <typename T>
+const AVL_tree_t<T> *AVL_tree_t<T>::nth_in_range(const T &lo, const T &hi, std::size_t k) const {
+	auto less = count_less(lo);
+	if (!k || k > size_ - less)
+		return nullptr;
+	auto node = get_nth(less + k);
+	return (hi < node->val_) ? nullptr : node;
+}
+
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::delete_node(AVL_tree_t *root, bool rebalance, AVL_storage_t *storage) {
+	destroy(detach_node(root, rebalance), storage);
+	return root;
+}
+
+// unlinks this node from the tree and returns it; it is first swapped down with its successor
+// (or predecessor) until it is a leaf, so no values are moved and other nodes keep theirs;
+// without rebalance the path is marked relaxed_dirty as in insert_relaxed
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::detach_node(AVL_tree_t *&root, bool rebalance) {
+	if (!rebalance)
+		return detach_relaxed(root);
+	while (right_ || left_)
+		swap_down(right_ ? right_->min() : left_->max(), root);
 	
-	auto del_node = node;
+	auto node = this;
+	auto del_node = this;
 	del_node->size_ = 0;
 	while (node->parent_) {
 		node = node->parent_;
 		node->size_--;
+		if (!rebalance)
+			node->h_dif_ = relaxed_dirty;
 	}
 	node = del_node;
-	while (node->parent_) {
+	while (rebalance && node->parent_) {
 		auto prev = node;
 		node = node->parent_;
 		if (node->left_ == prev)
@@ -258,15 +611,111 @@ AVL_tree_t<T> *AVL_tree_t<T>::delete_node(AVL_tree_t *root) {
 			node->h_dif_++;
 		if (node->h_dif_ == 1 || node->h_dif_ == -1)
 			break;
-		root = node->balance(root);
-		if (!node->h_dif_)
-			break;
+		if (node->h_dif_) {
+			root = node->balance(root);
+			node = node->parent_;
+			if (node->h_dif_)
+				break;
+		}
+	}
+	auto parent = del_node->parent_;
+	root = del_node->unlink_leaf(root);
+	if (parent)
+		parent->update_augment_path();
+	return del_node;
+}
+
+// heights are repaired later, so a node with one child is spliced out rather than swapped
+// down to a leaf: a single swap with the successor at most, and no second descent
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::detach_relaxed(AVL_tree_t *&root) {
+	if (left_ && right_)
+		swap_down(right_->min(), root);
+	auto parent = parent_;
+	auto child = left_ ? left_ : right_;
+	AVL_tree_t *&ptr_to_this = (parent) 	? ((parent->left_ == this)	? parent->left_
+										: parent->right_)
+						: root;
+	ptr_to_this = child;
+	if (child)
+		child->parent_ = parent;
+	for (auto node = parent; node; node = node->parent_) {
+		node->size_--;
+		node->h_dif_ = relaxed_dirty;
 	}
-	return del_node->delete_leaf(root);
+	if (parent)
+		parent->update_augment_path();
+	parent_ = left_ = right_ = nullptr;
+	size_ = 0;
+	return this;
+}
+
+// exchanges the places of this node and node, which lies in its subtree; balance factors
+// and sizes belong to the places and stay there
+template <typename T>
+void AVL_tree_t<T>::swap_down(AVL_tree_t *node, AVL_tree_t *&root) {
+	auto parent = parent_, left = left_, right = right_;
+	AVL_tree_t *&ptr_to_this = (parent_) 	? ((parent_->left_ == this)	? parent_->left_
+										: parent_->right_)
+						: root;
+	ptr_to_this = node;
+	if (node->parent_ == this) {
+		parent_ = node;
+		left_ = node->left_;
+		right_ = node->right_;
+		node->left_ = (left == node) ? this : left;
+		node->right_ = (right == node) ? this : right;
+	}
+	else {
+		AVL_tree_t *&ptr_to_node = (node->parent_->left_ == node) ? node->parent_->left_ : node->parent_->right_;
+		ptr_to_node = this;
+		parent_ = node->parent_;
+		left_ = node->left_;
+		right_ = node->right_;
+		node->left_ = left;
+		node->right_ = right;
+	}
+	node->parent_ = parent;
+	for (auto child : {left_, right_})
+		if (child)
+			child->parent_ = this;
+	for (auto child : {node->left_, node->right_})
+		if (child)
+			child->parent_ = node;
+	std::swap(h_dif_, node->h_dif_);
+	std::swap(size_, node->size_);
+}
+
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::delete_leaf(AVL_tree_t *root, AVL_storage_t *storage) {
+	root = unlink_leaf(root);
+	destroy(this, storage);
+	return root;
+}
+
+// moves this node to a new allocation from to, freeing the old one through from,
+// and returns the new node; the links to it, root included, are updated
+template <typename T>
+AVL_tree_t<T> *AVL_tree_t<T>::relocate(AVL_tree_t *&root, AVL_storage_t *from, AVL_storage_t *to) {
+	auto node = create(val_, parent_, to);
+	AVL_tree_t *&ptr_to_this = (parent_) 	? ((parent_->left_ == this)	? parent_->left_
+										: parent_->right_)
+						: root;
+	ptr_to_this = node;
+	node->left_ = left_;
+	node->right_ = right_;
+	if (left_)
+		left_->parent_ = node;
+	if (right_)
+		right_->parent_ = node;
+	node->h_dif_ = h_dif_;
+	node->size_ = size_;
+	destroy(this, from);
+	return node;
 }
 
 template <typename T>
-AVL_tree_t<T> *AVL_tree_t<T>::delete_leaf(AVL_tree_t *root) {
+AVL_tree_t<T> *AVL_tree_t<T>::unlink_leaf(AVL_tree_t *root) {
 	assert(!left_ && !right_);
 	if (!parent_)
 		root = nullptr;
@@ -274,7 +723,7 @@ AVL_tree_t<T> *AVL_tree_t<T>::delete_leaf(AVL_tree_t *root) {
 		parent_->left_ = nullptr;
 	else 
 		parent_->right_ = nullptr;
-	delete this;
+	parent_ = nullptr;
 	return root;
 }
 	
@@ -385,6 +834,8 @@ AVL_tree_t<T> *AVL_tree_t<T>::rotateLeft(AVL_tree_t<T> *root) {
 	going_up->left_ = this;
 
 	update_size();
+	update_augment();
+	going_up->update_augment();
 
 	return root;
 }
@@ -409,6 +860,8 @@ AVL_tree_t<T> *AVL_tree_t<T>::rotateRight(AVL_tree_t<T> *root) {
 	going_up->right_ = this;
 
 	update_size();
+	update_augment();
+	going_up->update_augment();
 
 	return root;
 }
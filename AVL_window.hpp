@@ -0,0 +1,128 @@
+#pragma once
+#include "AVL_set.hpp"
+#include <cassert>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace AVL
+{
+// Last capacity() pushed keys of a stream. The ring holds the tree nodes of the keys in
+// age order, so eviction needs no search, and once the window is full every push relinks
+// the node of the oldest key with the new one: the steady state does no allocations.
+template <typename T>
+class AVL_window_t final {
+	using node_t = AVL_tree_t<T>;
+	AVL_set_t<T> set_;
+	std::vector<const node_t *> ring_;
+	std::size_t head_ = 0;
+	std::size_t size_ = 0;
+
+	std::size_t slot(std::size_t age) const {
+		auto pos = head_ + age;
+		return (pos >= ring_.size()) ? pos - ring_.size() : pos;
+	}
+
+	public:
+	// a window of capacity 0, e.g. a moved-from one, keeps nothing
+	explicit AVL_window_t(std::size_t capacity) : ring_(capacity) {}
+	// the copied set has its own nodes, in the same order, so they are matched by position
+	AVL_window_t(const AVL_window_t &other) : set_(other.set_), ring_(other.ring_.size()), size_(other.size_) {
+		std::unordered_map<const node_t *, const node_t *> copies;
+		copies.reserve(size_);
+		for (auto from = other.set_.min(), to = set_.min(); from; from = from->next(), to = to->next())
+			copies.emplace(from, to);
+		for (std::size_t i = 0; i < size_; ++i)
+			ring_[i] = copies.at(other.ring_[other.slot(i)]);
+	}
+	AVL_window_t &operator = (const AVL_window_t &rhs) {
+		if (this != &rhs)
+			*this = AVL_window_t{rhs};
+		return *this;
+	}
+	AVL_window_t(AVL_window_t &&other) noexcept : AVL_window_t(0) {
+		*this = std::move(other);
+	}
+	// the source is left empty with capacity 0
+	AVL_window_t &operator = (AVL_window_t &&other) noexcept {
+		if (this == &other)
+			return *this;
+		set_ = std::move(other.set_);
+		other.set_.clear();
+		ring_ = std::move(other.ring_);
+		other.ring_.clear();
+		head_ = std::exchange(other.head_, 0);
+		size_ = std::exchange(other.size_, 0);
+		return *this;
+	}
+
+	void push(const T &elem) {
+		if (ring_.empty())
+			return;
+		auto tail = slot(size_);
+		if (size_ == ring_.size()) {
+			ring_[tail] = set_.replace_node(ring_[head_], elem);
+			head_ = (head_ + 1 == ring_.size()) ? 0 : head_ + 1;
+		}
+		else {
+			ring_[tail] = set_.insert_node(elem);
+			size_++;
+		}
+	}
+	// drops the oldest key
+	void evict() {
+		assert(size_);
+		set_.erase_node(ring_[head_]);
+		head_ = (head_ + 1 == ring_.size()) ? 0 : head_ + 1;
+		size_--;
+	}
+	// drops the n-th smallest key (starting from 1); its slot is closed up in the ring
+	// by moving the younger keys, in O(log n + capacity)
+	void evict_nth(std::size_t n) {
+		assert(n && n <= size_);
+		auto node = set_.get_root()->get_nth(n);
+		std::size_t age = 0;
+		while (ring_[slot(age)] != node)
+			age++;
+		for (; age + 1 < size_; ++age)
+			ring_[slot(age)] = ring_[slot(age + 1)];
+		set_.erase_node(node);
+		size_--;
+	}
+	T oldest() const {
+		assert(size_);
+		return ring_[head_]->get_val();
+	}
+	std::size_t size() const {
+		return size_;
+	}
+	std::size_t capacity() const {
+		return ring_.size();
+	}
+	bool empty() const {
+		return !size_;
+	}
+	const AVL_set_t<T> &get_set() const {
+		return set_;
+	}
+	std::size_t range_query(const std::pair<T, T> &query) const {
+		return set_.range_query(query);
+	}
+	std::size_t count_less(const T &elem) const {
+		return set_.count_less(elem);
+	}
+	std::size_t count_greater(const T &elem) const {
+		return set_.count_greater(elem);
+	}
+	const AVL_tree_t<T> *get_nth(std::size_t n) const {
+		assert(n && n <= size_);
+		return set_.get_root()->get_nth(n);
+	}
+	const AVL_tree_t<T> *quantile(double q) const {
+		return set_.quantile(q);
+	}
+	const AVL_tree_t<T> *median() const {
+		return set_.median();
+	}
+};
+} //namespace AVL
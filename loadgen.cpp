@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "AVL_server.hpp"
+
+// Each connection keeps depth requests in flight; latency is measured from sending
+// a window of requests to receiving its last answer.
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " socket_path [connections] [requests per connection] [depth] [key max]" << std::endl;
+		return 1;
+	}
+	std::string path = argv[1];
+	unsigned conns = (argc > 2) ? std::stoul(argv[2]) : 4;
+	std::size_t requests = (argc > 3) ? std::stoul(argv[3]) : 100000;
+	std::size_t depth = (argc > 4) ? std::stoul(argv[4]) : 16;
+	std::int32_t key_max = (argc > 5) ? std::stol(argv[5]) : 1000000;
+
+	std::vector<std::vector<double>> latencies(conns);
+	std::vector<std::thread> workers;
+	auto beg = std::chrono::steady_clock::now();
+	for (unsigned c = 0; c < conns; ++c)
+		workers.emplace_back([&, c] {
+			AVL::AVL_query_client_t client{path};
+			std::default_random_engine e{c};
+			std::uniform_int_distribution<std::int32_t> keys{0, key_max};
+			std::vector<AVL::query_t> queries(depth);
+			std::vector<std::uint64_t> answers(depth);
+			for (std::size_t sent = 0; sent < requests; sent += depth) {
+				auto n = std::min(depth, requests - sent);
+				for (std::size_t i = 0; i < n; ++i) {
+					auto first = keys(e);
+					auto second = keys(e);
+					queries[i] = {AVL::RANGE_QUERY, std::min(first, second), std::max(first, second)};
+				}
+				auto send_time = std::chrono::steady_clock::now();
+				client.send(queries.data(), n);
+				client.receive(answers.data(), n);
+				auto recv_time = std::chrono::steady_clock::now();
+				latencies[c].push_back(std::chrono::duration<double, std::micro>(recv_time - send_time).count());
+			}
+		});
+	for (auto &worker : workers)
+		worker.join();
+	auto end = std::chrono::steady_clock::now();
+
+	std::vector<double> all;
+	for (auto &v : latencies)
+		all.insert(all.end(), v.begin(), v.end());
+	std::sort(all.begin(), all.end());
+	auto time = std::chrono::duration<double>(end - beg).count();
+	std::cout	<< "Requests per second:" << std::endl << conns * requests / time << std::endl
+			<< "Window latency p50, us:" << std::endl << all[all.size() / 2] << std::endl
+			<< "Window latency p99, us:" << std::endl << all[all.size() * 99 / 100] << std::endl
+			<< "Window latency max, us:" << std::endl << all.back() << std::endl;
+}
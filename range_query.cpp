@@ -1,11 +1,25 @@
 #include <iostream>
 #include <queue>
 #include <utility>
+#include <vector>
 
 #ifdef STD
 #include <set>
 #include <iterator>
 #include <cassert>
+#elif defined(PARALLEL)
+#include <thread>
+#include "AVL_set.hpp"
+#elif defined(EXTERNAL)
+#include <iterator>
+#include <cstdlib>
+#include <thread>
+#include "AVL_external.hpp"
+#elif defined(PACKED)
+#include "AVL_packed_set.hpp"
+#elif defined(ARENA)
+#include "AVL_set.hpp"
+#include "AVL_arena.hpp"
 #else
 #include "AVL_set.hpp"
 #endif
@@ -13,6 +27,70 @@
 #ifdef TIME
 #define NDEBUG
 #include <chrono>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef TIME
+namespace {
+	// misses of a hardware cache counted for this process and the threads it starts;
+	// read() gives -1 where the PMU is not accessible (VMs, containers, perf_event_paranoid)
+	class perf_counter_t final {
+		int fd_;
+
+		public:
+		explicit perf_counter_t(unsigned long long cache) {
+			perf_event_attr attr{};
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+		perf_counter_t(const perf_counter_t &other) = delete;
+		perf_counter_t &operator = (const perf_counter_t &rhs) = delete;
+		~perf_counter_t() {
+			if (fd_ >= 0)
+				close(fd_);
+		}
+		long long read() const {
+			long long count;
+			if (fd_ < 0 || ::read(fd_, &count, sizeof(count)) != sizeof(count))
+				return -1;
+			return count;
+		}
+	};
+
+	void print_misses(const char *what, long long beg, long long end) {
+		std::cout << what << std::endl;
+		if (beg < 0 || end < 0)
+			std::cout << "n/a" << std::endl;
+		else
+			std::cout << end - beg << std::endl;
+	}
+}
+#endif
+
+#ifdef RELAXED
+namespace {
+	// insert/erase churn over a built set: a neighbour of every key goes in and is erased
+	// 16 inserts later, so the contents end as they started
+	void churn(AVL::AVL_set_t<int> &set, const std::vector<int> &keys, bool relaxed) {
+		constexpr std::size_t lag = 16;
+		set.set_relaxed(relaxed);
+		for (std::size_t i = 0; i < keys.size(); ++i) {
+			set.insert(keys[i] ^ 1);
+			if (i >= lag)
+				set.erase(keys[i - lag] ^ 1);
+		}
+		for (auto i = keys.size() - std::min(keys.size(), lag); i < keys.size(); ++i)
+			set.erase(keys[i] ^ 1);
+		set.set_relaxed(false);
+	}
+}
 #endif
 
 #ifdef STD
@@ -29,21 +107,80 @@ namespace {
 int main() {
 	std::size_t n;
 	std::cin >> n;
+#ifndef EXTERNAL
+	// keys are parsed before the build-up timer starts in every mode but EXTERNAL, which streams them
+	std::vector<int> keys(n);
+	for (auto &key : keys)
+		std::cin >> key;
+#endif
 #ifdef STD
 	std::set<int> set;
-#else
+#elif defined(PACKED)
+	AVL::AVL_packed_set_t<int> set;
+#elif defined(ARENA)
+	// explicit hugepages if the pool has them, THP otherwise
+	AVL::AVL_arena_t arena{AVL::page_mode_t::hugetlb, AVL::numa_policy_t::interleave};
+	AVL::AVL_set_t<int> set{&arena};
+#elif !defined(EXTERNAL) && !defined(PARALLEL)
 	AVL::AVL_set_t<int> set;
 #endif
 #ifdef TIME
+	// dTLB misses, and last level misses served by another NUMA node's memory
+	perf_counter_t dtlb{PERF_COUNT_HW_CACHE_DTLB};
+	perf_counter_t remote{PERF_COUNT_HW_CACHE_NODE};
 	auto buildup_beg = std::chrono::high_resolution_clock::now();
+	auto buildup_dtlb = dtlb.read(), buildup_remote = remote.read();
+#endif
+#ifdef PARALLEL
+	AVL::AVL_set_t<int> set{keys.begin(), keys.end(), std::max(std::thread::hardware_concurrency(), 1u)};
+#elif defined(EXTERNAL)
+	char path[] = "/tmp/avl_sortedXXXXXX";
+	close(mkstemp(path));
+	if (n)
+		AVL::external_sort<int>(std::istream_iterator<int>{std::cin}, n, path, 1 << 24, 1 << 16,
+					std::max(std::thread::hardware_concurrency(), 1u));
+	AVL::AVL_sorted_file_t<int> index{path};
+	unlink(path);
+#else
+#ifdef RELAXED
+	set.set_relaxed(true);
+#endif
+	for (auto key : keys)
+		set.insert(key);
+#ifdef RELAXED
+	set.set_relaxed(false);
+#endif
 #endif
-	for (auto i = 0LU; i < n; ++i) {
-		int tmp = 0;
-		std::cin >> tmp;
-		set.insert(tmp);
-	}
 #ifdef TIME
 	auto buildup_end = std::chrono::high_resolution_clock::now();
+	auto buildup_dtlb_end = dtlb.read(), buildup_remote_end = remote.read();
+#endif
+#ifdef RELAXED
+#ifdef TIME
+	// relaxed mode loses on a build from empty, where its paths are longer than AVL ones,
+	// and pays off on churn over a large tree, where it skips the rotations of erase
+	auto strict_churned = set;
+	auto churn_strict_beg = std::chrono::high_resolution_clock::now();
+	churn(strict_churned, keys, false);
+	auto churn_strict_end = std::chrono::high_resolution_clock::now();
+	strict_churned.clear();
+	auto relaxed_churned = set;
+	auto churn_relaxed_beg = std::chrono::high_resolution_clock::now();
+	churn(relaxed_churned, keys, true);
+	auto churn_relaxed_end = std::chrono::high_resolution_clock::now();
+	relaxed_churned.clear();
+#else
+	churn(set, keys, true);
+#endif
+#endif
+#ifdef COMPACT
+#ifdef TIME
+	auto compact_beg = std::chrono::high_resolution_clock::now();
+#endif
+	set.compact();
+#ifdef TIME
+	auto compact_end = std::chrono::high_resolution_clock::now();
+#endif
 #endif
 	std::size_t n_queries;
 	std::cin >> n_queries;
@@ -57,11 +194,14 @@ int main() {
 	
 	std::queue<std::size_t> answers;
 #ifdef TIME
+	auto queries_dtlb = dtlb.read(), queries_remote = remote.read();
 	auto queries_beg = std::chrono::high_resolution_clock::now();
 #endif
 	while (!queries.empty()) {
 #ifdef STD
 		answers.emplace(range_query(set, queries.front()));
+#elif defined(EXTERNAL)
+		answers.emplace(index.range_query(queries.front()));
 #else
 		answers.emplace(set.range_query(queries.front()));
 #endif
@@ -69,8 +209,32 @@ int main() {
 	}
 #ifdef TIME
 	auto queries_end = std::chrono::high_resolution_clock::now();
+	auto queries_dtlb_end = dtlb.read(), queries_remote_end = remote.read();
 	std::cout << "Build-up time, s:" << std::endl << std::chrono::duration<double>(buildup_end - buildup_beg).count() << std::endl
 		<< "Queries time, s:" << std::endl << std::chrono::duration<double>(queries_end - queries_beg).count() << std::endl;
+	print_misses("Build-up dTLB load misses:", buildup_dtlb, buildup_dtlb_end);
+	print_misses("Build-up remote node loads:", buildup_remote, buildup_remote_end);
+	print_misses("Queries dTLB load misses:", queries_dtlb, queries_dtlb_end);
+	print_misses("Queries remote node loads:", queries_remote, queries_remote_end);
+#ifdef RELAXED
+	std::cout << "Churn time, strict, s:" << std::endl << std::chrono::duration<double>(churn_strict_end - churn_strict_beg).count() << std::endl
+		<< "Churn time, relaxed with repair, s:" << std::endl << std::chrono::duration<double>(churn_relaxed_end - churn_relaxed_beg).count() << std::endl;
+#endif
+#ifdef COMPACT
+	std::cout << "Compaction time, s:" << std::endl << std::chrono::duration<double>(compact_end - compact_beg).count() << std::endl;
+#endif
+#ifdef PACKED
+	std::cout << "Bytes per key:" << std::endl << static_cast<double>(set.bytes()) / (set.size() ? set.size() : 1) << std::endl;
+#endif
+#ifdef ARENA
+	std::cout << "Hugetlb backed, MB:" << std::endl << (arena.hugetlb_bytes() >> 20) << " of " << (arena.mapped_bytes() >> 20) << std::endl;
+#endif
+#ifndef EXTERNAL
+	auto teardown_beg = std::chrono::high_resolution_clock::now();
+	set.clear();
+	auto teardown_end = std::chrono::high_resolution_clock::now();
+	std::cout << "Teardown time, s:" << std::endl << std::chrono::duration<double>(teardown_end - teardown_beg).count() << std::endl;
+#endif
 #else	
 	while (!answers.empty()) {
 		std::cout << answers.front() << ' ';
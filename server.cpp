@@ -0,0 +1,31 @@
+#include <atomic>
+#include <csignal>
+#include <iostream>
+#include <thread>
+#include "AVL_server.hpp"
+
+namespace {
+std::atomic<bool> stop{false};
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " socket_path [threads] < keys" << std::endl;
+		return 1;
+	}
+	unsigned threads = (argc > 2) ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+	std::size_t n;
+	std::cin >> n;
+	std::vector<std::int32_t> keys(n);
+	for (auto &key : keys)
+		std::cin >> key;
+	AVL::AVL_set_t<std::int32_t> set{keys.begin(), keys.end(), threads};
+	keys = std::vector<std::int32_t>{};
+
+	std::signal(SIGINT, [](int) { stop = true; });
+	std::signal(SIGTERM, [](int) { stop = true; });
+	AVL::AVL_query_server_t server{set, argv[1], threads};
+	std::clog << "Serving " << set.size() << " keys at " << argv[1] << std::endl;
+	server.run(stop);
+	std::clog << "Batches served: " << server.batches() << std::endl;
+}
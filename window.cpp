@@ -0,0 +1,35 @@
+#include <iostream>
+#include <vector>
+#include "AVL_window.hpp"
+#ifdef TIME
+#include <chrono>
+#endif
+
+int main() {
+	std::size_t capacity, n;
+	std::cin >> capacity >> n;
+	std::vector<int> events(n);
+	for (auto &event : events)
+		std::cin >> event;
+
+	AVL::AVL_window_t<int> window{capacity};
+#ifdef TIME
+	long long checksum = 0;
+	auto beg = std::chrono::high_resolution_clock::now();
+	for (auto event : events) {
+		window.push(event);
+		checksum += window.median()->get_val();
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	auto time = std::chrono::duration<double>(end - beg).count();
+	std::cout	<< "Push + median time, s:" << std::endl << time << std::endl
+			<< "Events per second:" << std::endl << n / time << std::endl
+			<< "Checksum:" << std::endl << checksum << std::endl;
+#else
+	for (auto event : events) {
+		window.push(event);
+		std::cout << window.median()->get_val() << ' ';
+	}
+	std::cout << std::endl;
+#endif
+}